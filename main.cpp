@@ -1,267 +1,6889 @@
-/*
- * В представленном коде есть нарушение принципа открытости/закрытости (Open/Closed Principle).
- *  Принцип открытости/закрытости гласит, что программные сущности (классы, модули, функции и т.д.) должны быть открыты для расширения,
- *  но закрыты для модификации. Он помогает создавать гибкую архитектуру, которая может быть
- *  легко расширена новым функционалом без необходимости изменения существующего кода.
- *  В данном случае, класс DrwManager содержит жестко закодированные условия для рисования фигур.
- *  Когда добавляется новый тип фигуры (например, треугольник), необходимо изменять код внутри метода drawShapes,
- *  добавлять новое условие и соответствующую логику рисования. Это нарушает принцип открытости/закрытости,
- *  так как при добавлении нового типа фигуры нужно модифицировать существующий код.
- *  Для исправления этой проблемы можно применить принцип полиморфизма и использовать виртуальные функции.
- *  Вместо жестко закодированных условий для каждого типа фигуры, можно определить виртуальную функцию draw в базовом классе Shape,
- *  которую каждый дочерний класс будет переопределять по своему.
- *  Затем, в цикле drawShapes можно вызывать эту виртуальную функцию для каждого элемента в списке shapeList,
- *  и правильная реализация draw будет автоматически выбрана в соответствии с типом объекта.
-*/
-
-#include<iostream>
-#include<memory>
-#include <vector>
-#include<list>
-
-// Структура описывающая точку
-struct Point
-{
-    int x;
-    int y;
-    Point(int _x = 0, int _y = 0) { x = _x; y = _y; }
-};
-// Базовый класс фигура
-class Shape {
-public:
-    // Здесь конструкторы, геттеры и сеттеры Get / Set
-    Shape(Point c) { center = c; type = "BaseFigure"; }
-    virtual ~Shape() {} // Виртуальный деструктор для полиморфного удаления объектов
-
-    std::string GetType() const { return type; }
-
-    // Виртуальная функция рисования, будет переопределена в дочерних классах
-    virtual void Draw() const = 0;
-
-protected:
-    Point center;
-    std::string type;
-};
-
-class Circle : public Shape {
-public:
-    // Здесь конструкторы, геттеры и сеттеры Get / Set
-    Circle(Point cnt, int r) : Shape(cnt) { radius = r; type = "Circle"; }
-
-    void Draw() const override {
-        std::cout << "Draw Circle!\n";
-    }
-
-private:
-    int radius;
-};
-
-class Square : public Shape {
-public:
-    // Здесь конструкторы, геттеры и сеттеры Get / Set
-    Square(Point cnt, int r) : Shape(cnt) { side = r; type = "Square"; }
-
-    void Draw() const override {
-        std::cout << "Draw Square!\n";
-    }
-
-private:
-    int side;
-};
-
-class DrwManager {
-private:
-    std::list<std::shared_ptr<Shape>> shapeList; // Используем умные указатели для управления памятью объектов
-
-public:
-    // Здесь различные конструкторы
-    DrwManager() {
-        // Такая инициализация только для примера
-        Point p(0, 0);
-        shapeList.push_back(std::make_shared<Square>(p, 3));
-        shapeList.push_back(std::make_shared<Circle>(p, 3));
-    }
-
-    // Метод рисует все фигуры из списка shapeList
-    void drawShapes() {
-        for (const auto& shape : shapeList) {
-            shape->Draw();
-        }
-    }
-};
-
-/*В исправленном коде добавлен виртуальный деструктор в базовый класс Shape,
- *  чтобы обеспечить правильное удаление объектов при полиморфном использовании.
- *  Класс DrwManager теперь использует список указателей на базовый класс Shape с помощью std::unique_ptr,
- *  что позволяет автоматически управлять памятью объектов. В методе drawShapes вызывается полиморфная функция Draw,
- *  которая рисует каждую фигуру соответствующим образом, и не требует изменений при добавлении новых типов фигур.
-*/
-#include <iostream>
-#include <string>
-#include <memory>
-
-// интерфейс Phone
-class Phone {
-public:
-    virtual std::string getName() = 0;
-};
-
-// Абстрактный продукт Smartphone, наследующийся от Phone
-class Smartphone : public Phone {
-};
-
-// Абстрактный продукт BasicPhone, наследующийся от Phone
-class BasicPhone : public Phone {
-};
-
-// Абстрактная фабрика PhoneFactory
-class PhoneFactory {
-public:
-    virtual std::shared_ptr<Smartphone> createSmartphone(std::string name) = 0;
-    virtual std::shared_ptr<BasicPhone> createBasicPhone(std::string name) = 0;
-};
-
-// Конкретный продукт NokiaSmartphone, наследующийся от Smartphone
-class NokiaSmartphone : public Smartphone {
-    std::string name;
-
-public:
-    NokiaSmartphone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретный продукт NokiaBasicPhone, наследующийся от BasicPhone
-class NokiaBasicPhone : public BasicPhone {
-    std::string name;
-
-public:
-    NokiaBasicPhone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретный продукт SamsungSmartphone, наследующийся от Smartphone
-class SamsungSmartphone : public Smartphone {
-    std::string name;
-
-public:
-    SamsungSmartphone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретный продукт SamsungBasicPhone, наследующийся от BasicPhone
-class SamsungBasicPhone : public BasicPhone {
-    std::string name;
-
-public:
-    SamsungBasicPhone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретный продукт HTCSmartphone, наследующийся от Smartphone
-class HTCSmartphone : public Smartphone {
-    std::string name;
-
-public:
-    HTCSmartphone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретный продукт HTCBasicPhone, наследующийся от BasicPhone
-class HTCBasicPhone : public BasicPhone {
-    std::string name;
-
-public:
-    HTCBasicPhone(std::string name) : name(name) {}
-
-    std::string getName() override {
-        return name;
-    }
-};
-
-// Конкретная фабрика NokiaFactory, наследующаяся от PhoneFactory
-class NokiaFactory : public PhoneFactory {
-public:
-    std::shared_ptr<Smartphone> createSmartphone(std::string name) override {
-        return std::make_shared<NokiaSmartphone>(name);
-    }
-
-    std::shared_ptr<BasicPhone> createBasicPhone(std::string name) override {
-        return std::make_shared<NokiaBasicPhone>(name);
-    }
-};
-
-// Конкретная фабрика SamsungFactory, наследующаяся от PhoneFactory
-class SamsungFactory : public PhoneFactory {
-public:
-    std::shared_ptr<Smartphone> createSmartphone(std::string name) override {
-        return std::make_shared<SamsungSmartphone>(name);
-    }
-
-    std::shared_ptr<BasicPhone> createBasicPhone(std::string name) override {
-        return std::make_shared<SamsungBasicPhone>(name);
-    }
-};
-
-// Конкретная фабрика HTCFactory, наследующаяся от PhoneFactory
-class HTCFactory : public PhoneFactory {
-public:
-    std::shared_ptr<Smartphone> createSmartphone(std::string name) override {
-        return std::make_shared<HTCSmartphone>(name);
-    }
-
-    std::shared_ptr<BasicPhone> createBasicPhone(std::string name) override {
-        return std::make_shared<HTCBasicPhone>(name);
-    }
-};
-
-int main() {
-    std::string man;
-    for (int i = 0; i < 3; ++i) {
-        std::shared_ptr<PhoneFactory> factory;
-        std::shared_ptr<Smartphone> smartphone;
-        std::shared_ptr<BasicPhone> basicPhone;
-
-        switch (i) {
-            case 0:
-                factory = std::make_shared<NokiaFactory>();
-                smartphone = factory->createSmartphone("Nokia Smartphone");
-                basicPhone = factory->createBasicPhone("Nokia Basic Phone");
-                man = "Nokia";
-                break;
-            case 1:
-                factory = std::make_shared<SamsungFactory>();
-                smartphone = factory->createSmartphone("Samsung Smartphone");
-                basicPhone = factory->createBasicPhone("Samsung Basic Phone");
-                man = "Samsung";
-                break;
-            case 2:
-                factory = std::make_shared<HTCFactory>();
-                smartphone = factory->createSmartphone("HTC Smartphone");
-                basicPhone = factory->createBasicPhone("HTC Basic Phone");
-                man = "HTC";
-                break;
-        }
-
-        std::cout << "Manufacturer: " << man << "\n";
-        std::cout << "Smarphone: " << smartphone->getName() << "\n";
-        std::cout << "Basic phone: " << basicPhone->getName() << "\n";
-    }
-
-    return 0;
-}
-
+/*
+ * В представленном коде есть нарушение принципа открытости/закрытости (Open/Closed Principle).
+ *  Принцип открытости/закрытости гласит, что программные сущности (классы, модули, функции и т.д.) должны быть открыты для расширения,
+ *  но закрыты для модификации. Он помогает создавать гибкую архитектуру, которая может быть
+ *  легко расширена новым функционалом без необходимости изменения существующего кода.
+ *  В данном случае, класс DrwManager содержит жестко закодированные условия для рисования фигур.
+ *  Когда добавляется новый тип фигуры (например, треугольник), необходимо изменять код внутри метода drawShapes,
+ *  добавлять новое условие и соответствующую логику рисования. Это нарушает принцип открытости/закрытости,
+ *  так как при добавлении нового типа фигуры нужно модифицировать существующий код.
+ *  Для исправления этой проблемы можно применить принцип полиморфизма и использовать виртуальные функции.
+ *  Вместо жестко закодированных условий для каждого типа фигуры, можно определить виртуальную функцию draw в базовом классе Shape,
+ *  которую каждый дочерний класс будет переопределять по своему.
+ *  Затем, в цикле drawShapes можно вызывать эту виртуальную функцию для каждого элемента в списке shapeList,
+ *  и правильная реализация draw будет автоматически выбрана в соответствии с типом объекта.
+*/
+
+#include<iostream>
+#include<memory>
+#include <vector>
+#include<list>
+#include<string>
+#include<cstdint>
+#include<thread>
+#include<mutex>
+#include<condition_variable>
+#include<deque>
+#include<functional>
+#include<atomic>
+#include<exception>
+#include<algorithm>
+#include<new>
+#include<type_traits>
+#include<variant>
+#include<array>
+#include<string_view>
+#include<unordered_map>
+#include<chrono>
+#include<cmath>
+#include<fstream>
+#include<cstring>
+#include<optional>
+#include<limits>
+#include<system_error>
+#include<cerrno>
+#if defined(__unix__) || defined(__APPLE__)
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<sys/uio.h>
+#include<unistd.h>
+#define CP_TRPO_HAS_MMAP 1
+#define CP_TRPO_HAS_WRITEV 1
+#endif
+// Файл сцены всегда little-endian; на big-endian процессоре поля переставляются при записи и чтении
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CP_TRPO_BIG_ENDIAN 1
+#endif
+// Встроенные счётчики рисования DrawStats; сборка с -DCP_TRPO_NO_DRAW_STATS убирает их полностью
+#if !defined(CP_TRPO_NO_DRAW_STATS)
+#define CP_TRPO_DRAW_STATS 1
+#endif
+#if defined(__AVX2__)
+#include<immintrin.h>
+#if defined(_MSC_VER)
+#include<intrin.h>
+#endif
+#endif
+
+// Структура описывающая точку
+struct Point
+{
+    int x;
+    int y;
+    constexpr Point(int _x = 0, int _y = 0) : x(_x), y(_y) {}
+};
+
+// Прямоугольник, выровненный по осям; границы включительно
+struct Rect {
+    int minX, minY, maxX, maxY;
+
+    bool Intersects(const Rect& o) const {
+        return minX <= o.maxX && o.minX <= maxX && minY <= o.maxY && o.minY <= maxY;
+    }
+};
+
+// Модуль размера фигуры. INT_MIN не отрицается (переполнение), а сводится к INT_MAX
+inline int SizeMagnitude(int size) {
+    if (size >= 0)
+        return size;
+    return size == std::numeric_limits<int>::min() ? std::numeric_limits<int>::max() : -size;
+}
+
+// Код команды рисования
+enum class DrawOp : std::uint8_t {
+    Circle = 1,
+    Square = 2,
+    Dot = 3,    // фигура меньше порога LOD: одна точка в центре, размер - исходный
+    Cluster = 4 // метка ячейки LOD, заменяющая мелкие фигуры: центр ячейки, размер - число фигур
+};
+
+// Компактная запись одной команды рисования: код, центр и размер (радиус / сторона)
+struct DrawCmd {
+    DrawOp op;
+    Point center;
+    int size;
+};
+
+// Буфер команд рисования. Фигуры добавляют в него записи вместо прямого вывода в поток
+class CommandBuffer {
+public:
+    void Push(DrawOp op, Point c, int size) { cmds.push_back(DrawCmd{ op, c, size }); }
+    void Push(const DrawCmd& cmd) { cmds.push_back(cmd); }
+    void Append(const CommandBuffer& other) { cmds.insert(cmds.end(), other.cmds.begin(), other.cmds.end()); }
+    void Append(const DrawCmd* first, std::size_t n) { cmds.insert(cmds.end(), first, first + n); }
+
+    const std::vector<DrawCmd>& Commands() const { return cmds; }
+    std::size_t Size() const { return cmds.size(); }
+    bool Empty() const { return cmds.empty(); }
+    void Reserve(std::size_t n) { cmds.reserve(n); }
+    void Clear() { cmds.clear(); } // память буфера сохраняется для следующего кадра
+
+protected:
+    std::vector<DrawCmd> cmds;
+};
+
+// Группа одинаковых фигур (код команды и размер), отличающихся только центром: одна инстанс-команда
+struct InstanceBatch {
+    DrawOp op;
+    int size;
+    std::uint32_t first; // первый центр группы в InstanceBuffer
+    std::uint32_t count;
+};
+
+// Кадр в инстансном виде: группы и общий массив центров, центры каждой группы лежат подряд.
+// Так данные передаются GPU-бэкендам: по вызову на группу вместо вызова на фигуру
+class InstanceBuffer {
+public:
+    // Группы из последовательных одинаковых команд: порядок рисования сохраняется полностью
+    void BuildRuns(const DrawCmd* cmds, std::size_t n) {
+        Clear();
+        centers.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (batches.empty() || batches.back().op != cmds[i].op || batches.back().size != cmds[i].size)
+                batches.push_back(InstanceBatch{ cmds[i].op, cmds[i].size, static_cast<std::uint32_t>(i), 0 });
+            ++batches.back().count;
+            centers[i] = cmds[i].center;
+        }
+    }
+
+    // Одна группа на пару (код, размер) по всему кадру, группы - в порядке первого появления.
+    // Порядок фигур внутри группы сохраняется, между группами - нет
+    void BuildBuckets(const DrawCmd* cmds, std::size_t n) {
+        Clear();
+        bucketOf.resize(n);
+        std::uint64_t lastKey = 0;
+        std::uint32_t last = UINT32_MAX;
+        for (std::size_t i = 0; i < n; ++i) {
+            const std::uint64_t key = (static_cast<std::uint64_t>(cmds[i].op) << 32) | static_cast<std::uint32_t>(cmds[i].size);
+            if (last == UINT32_MAX || key != lastKey) {
+                auto it = bucketIndex.try_emplace(key, static_cast<std::uint32_t>(batches.size()));
+                if (it.second)
+                    batches.push_back(InstanceBatch{ cmds[i].op, cmds[i].size, 0, 0 });
+                lastKey = key;
+                last = it.first->second;
+            }
+            ++batches[last].count;
+            bucketOf[i] = last;
+        }
+        std::uint32_t first = 0;
+        for (InstanceBatch& b : batches) {
+            b.first = first;
+            first += b.count;
+            b.count = 0;
+        }
+        centers.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            InstanceBatch& b = batches[bucketOf[i]];
+            centers[b.first + b.count++] = cmds[i].center;
+        }
+    }
+
+    const std::vector<InstanceBatch>& Batches() const { return batches; }
+    const Point* Centers(const InstanceBatch& b) const { return centers.data() + b.first; }
+    std::size_t InstanceCount() const { return centers.size(); }
+    bool Empty() const { return centers.empty(); }
+
+    void Clear() {
+        batches.clear();
+        centers.clear();
+        bucketIndex.clear();
+    }
+
+    // Обратное преобразование в отдельные команды
+    void Expand(CommandBuffer& out) const {
+        out.Reserve(out.Size() + centers.size());
+        for (const InstanceBatch& b : batches)
+            for (std::uint32_t i = 0; i < b.count; ++i)
+                out.Push(b.op, centers[b.first + i], b.size);
+    }
+
+private:
+    std::vector<InstanceBatch> batches;
+    std::vector<Point> centers;
+    std::unordered_map<std::uint64_t, std::uint32_t> bucketIndex; // (код, размер) -> группа
+    std::vector<std::uint32_t> bucketOf; // группа каждой команды, переиспользуется между кадрами
+};
+
+// Устройство вывода: приёмники рисования и отчёты пишут через него, а не прямо в std::cout.
+// Write() передаёт байты дальше (возможно, в буфер), Flush() доводит накопленное до устройства
+class OutputWriter {
+public:
+    virtual ~OutputWriter() {}
+
+    virtual void Write(const char* data, std::size_t n) = 0;
+    void Write(std::string_view s) { Write(s.data(), s.size()); }
+
+    // Несколько кусков подряд; по умолчанию - по одному Write() на кусок
+    virtual void WriteV(const std::string_view* parts, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i)
+            Write(parts[i].data(), parts[i].size());
+    }
+
+    virtual void Flush() {}
+};
+
+// Вывод в std::ostream. Для std::cout быстрее всего с std::ios::sync_with_stdio(false) до начала вывода
+class StreamWriter final : public OutputWriter {
+public:
+    explicit StreamWriter(std::ostream& os) : out(os) {}
+
+    using OutputWriter::Write;
+    void Write(const char* data, std::size_t n) override { out.write(data, static_cast<std::streamsize>(n)); }
+    void Flush() override { out.flush(); }
+
+private:
+    std::ostream& out;
+};
+
+#if defined(CP_TRPO_HAS_WRITEV)
+// Вывод в файловый дескриптор мимо потоков C++: Write() - write(2), куски WriteV() - один writev(2).
+// Ошибка записи - std::system_error. Бэкенда io_uring нет: он требует liburing, которой нет в сборке
+class FdWriter final : public OutputWriter {
+public:
+    FdWriter() = default;
+    // Чужой дескриптор (например, STDOUT_FILENO): пишется, но не закрывается
+    explicit FdWriter(int descriptor) : fd(descriptor) {}
+    ~FdWriter() { close(); }
+
+    FdWriter(const FdWriter&) = delete;
+    FdWriter& operator=(const FdWriter&) = delete;
+
+    // Создаёт или обрезает файл; false, если открыть не удалось
+    bool open(const std::string& path) {
+        close();
+        const int d = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (d < 0)
+            return false;
+        fd = d;
+        owned = true;
+        return true;
+    }
+
+    void close() {
+        if (owned && fd >= 0)
+            ::close(fd);
+        fd = -1;
+        owned = false;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    using OutputWriter::Write;
+    void Write(const char* data, std::size_t n) override {
+        while (n > 0) {
+            const ssize_t w = ::write(fd, data, n);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "FdWriter: write");
+            }
+            data += w;
+            n -= static_cast<std::size_t>(w);
+        }
+    }
+
+    void WriteV(const std::string_view* parts, std::size_t count) override {
+        while (count > 0) {
+            const std::size_t k = std::min(count, MaxParts);
+            iovec iov[MaxParts];
+            for (std::size_t i = 0; i < k; ++i) {
+                iov[i].iov_base = const_cast<char*>(parts[i].data());
+                iov[i].iov_len = parts[i].size();
+            }
+            const ssize_t w = ::writev(fd, iov, static_cast<int>(k));
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::system_error(errno, std::generic_category(), "FdWriter: writev");
+            }
+            // Пропускаем записанные куски; недописанный остаток куска - обычным Write()
+            std::size_t done = static_cast<std::size_t>(w);
+            std::size_t i = 0;
+            for (; i < k && done >= parts[i].size(); ++i)
+                done -= parts[i].size();
+            if (i < k) {
+                Write(parts[i].data() + done, parts[i].size() - done);
+                ++i;
+            }
+            parts += i;
+            count -= i;
+        }
+    }
+
+private:
+    static constexpr std::size_t MaxParts = 64;
+
+    int fd = -1;
+    bool owned = false;
+};
+#endif
+
+// Большой буфер в памяти процесса перед другим писателем: мелкие записи копируются в буфер,
+// дальше данные уходят кусками по capacity байт. Запись не меньше половины буфера не копируется,
+// а уходит вместе с накопленным одним WriteV() (у FdWriter - одним writev).
+// Деструктор выводит остаток, но ошибку этого вывода теряет: чтобы узнать о ней, нужен явный Flush()
+class BufferedWriter final : public OutputWriter {
+public:
+    static const std::size_t DefaultCapacity = 1 << 20;
+
+    explicit BufferedWriter(OutputWriter& backend, std::size_t capacity = DefaultCapacity)
+        : next(backend), buffer(std::max<std::size_t>(capacity, 2)) {}
+    ~BufferedWriter() {
+        try {
+            drain();
+        } catch (...) {
+        }
+    }
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    using OutputWriter::Write;
+    void Write(const char* data, std::size_t n) override {
+        if (n <= buffer.size() - used) {
+            std::memcpy(buffer.data() + used, data, n);
+            used += n;
+            return;
+        }
+        if (n >= buffer.size() / 2) {
+            const std::string_view parts[2] = { std::string_view(buffer.data(), used), std::string_view(data, n) };
+            next.WriteV(parts, 2);
+            used = 0;
+            return;
+        }
+        drain();
+        std::memcpy(buffer.data(), data, n);
+        used = n;
+    }
+
+    void Flush() override {
+        drain();
+        next.Flush();
+    }
+
+    std::size_t Buffered() const { return used; }
+
+private:
+    void drain() {
+        if (used) {
+            next.Write(buffer.data(), used);
+            used = 0;
+        }
+    }
+
+    OutputWriter& next;
+    std::vector<char> buffer;
+    std::size_t used = 0;
+};
+
+// Приёмник команд рисования: копит команды кадра и выводит их одной записью при Flush()
+class RenderSink : public CommandBuffer {
+public:
+    // Вывод в поток; после каждого кадра поток сбрасывается, как прежний построчный вывод
+    explicit RenderSink(std::ostream& os) : stream(std::in_place, os), writer(&*stream), flushFrames(true) {}
+    // Вывод через писателя. Писатель не сбрасывается после кадров: когда данные уходят на устройство,
+    // решает его владелец (Flush() писателя или буфер BufferedWriter)
+    explicit RenderSink(OutputWriter& w) : writer(&w), flushFrames(false) {}
+    virtual ~RenderSink() {}
+
+    RenderSink(const RenderSink&) = delete;
+    RenderSink& operator=(const RenderSink&) = delete;
+
+    // Выводит накопленные команды и очищает буфер
+    void Flush() {
+        FlushBuffer(*this);
+        Clear();
+    }
+
+    // Кодирует команды произвольного буфера и выводит их одной операцией записи
+    void FlushBuffer(const CommandBuffer& buf) {
+        if (buf.Empty())
+            return;
+        bytes.clear();
+        Encode(buf, bytes);
+        writeBytes();
+    }
+
+    // Выводит кадр в инстансном виде одной операцией записи. Накопленные команды не затрагиваются
+    void FlushInstanced(const InstanceBuffer& inst) {
+        if (inst.Empty())
+            return;
+        bytes.clear();
+        EncodeInstanced(inst, bytes);
+        writeBytes();
+    }
+
+    // Число непустых выводов и выведенных байт за время жизни приёмника; без счётчиков рисования - 0
+#if defined(CP_TRPO_DRAW_STATS)
+    std::uint64_t FlushCount() const { return flushes; }
+    std::uint64_t BytesWritten() const { return written; }
+#else
+    std::uint64_t FlushCount() const { return 0; }
+    std::uint64_t BytesWritten() const { return 0; }
+#endif
+
+protected:
+    virtual void Encode(const CommandBuffer& buf, std::string& dst) const = 0;
+
+    // По умолчанию группы разворачиваются в отдельные команды и кодируются через Encode()
+    virtual void EncodeInstanced(const InstanceBuffer& inst, std::string& dst) const {
+        CommandBuffer expanded;
+        inst.Expand(expanded);
+        Encode(expanded, dst);
+    }
+
+private:
+    void writeBytes() {
+        writer->Write(bytes.data(), bytes.size());
+        if (flushFrames)
+            writer->Flush();
+#if defined(CP_TRPO_DRAW_STATS)
+        ++flushes;
+        written += bytes.size();
+#endif
+    }
+
+    std::optional<StreamWriter> stream; // писатель для конструктора от std::ostream
+    OutputWriter* writer;
+    bool flushFrames;
+    std::string bytes; // буфер кодирования переиспользуется между кадрами
+#if defined(CP_TRPO_DRAW_STATS)
+    std::uint64_t flushes = 0;
+    std::uint64_t written = 0;
+#endif
+};
+
+// Текстовый приёмник: вывод совпадает с прежним построчным выводом Draw()
+class TextRenderSink : public RenderSink {
+public:
+    using RenderSink::RenderSink;
+
+protected:
+    void Encode(const CommandBuffer& buf, std::string& dst) const override {
+        dst.reserve(dst.size() + buf.Size() * LineLength);
+        for (const DrawCmd& cmd : buf.Commands())
+            dst.append(lineFor(cmd.op));
+    }
+
+    // Текст не зависит от центра: каждая группа - count одинаковых строк, вывод как у drawShapes()
+    void EncodeInstanced(const InstanceBuffer& inst, std::string& dst) const override {
+        dst.reserve(dst.size() + inst.InstanceCount() * LineLength);
+        for (const InstanceBatch& b : inst.Batches()) {
+            const std::string_view line = lineFor(b.op);
+            for (std::uint32_t i = 0; i < b.count; ++i)
+                dst.append(line);
+        }
+    }
+
+private:
+    static const std::size_t LineLength = sizeof("Draw Square!\n") - 1;
+
+    static std::string_view lineFor(DrawOp op) {
+        switch (op) {
+        case DrawOp::Circle:
+            return "Draw Circle!\n";
+        case DrawOp::Dot:
+            return "Draw Dot!\n";
+        case DrawOp::Cluster:
+            return "Draw Cluster!\n";
+        default:
+            return "Draw Square!\n";
+        }
+    }
+};
+
+// Двоичный приёмник. Формат кадра: uint32 число команд, затем записи по 13 байт:
+// uint8 код команды, int32 x, int32 y, int32 размер (все числа little-endian).
+// Инстансный кадр: uint32 (InstancedFlag | число групп), затем на группу uint8 код, int32 размер,
+// uint32 число центров и центры по 8 байт (int32 x, int32 y)
+class BinaryRenderSink : public RenderSink {
+public:
+    using RenderSink::RenderSink;
+
+    static const std::size_t RecordSize = 13;
+    static const std::uint32_t InstancedFlag = 0x80000000u;
+
+protected:
+    void Encode(const CommandBuffer& buf, std::string& dst) const override {
+        dst.reserve(dst.size() + 4 + buf.Size() * RecordSize);
+        appendU32(dst, static_cast<std::uint32_t>(buf.Size()));
+        for (const DrawCmd& cmd : buf.Commands()) {
+            dst.push_back(static_cast<char>(cmd.op));
+            appendU32(dst, static_cast<std::uint32_t>(cmd.center.x));
+            appendU32(dst, static_cast<std::uint32_t>(cmd.center.y));
+            appendU32(dst, static_cast<std::uint32_t>(cmd.size));
+        }
+    }
+
+    void EncodeInstanced(const InstanceBuffer& inst, std::string& dst) const override {
+        dst.reserve(dst.size() + 4 + inst.Batches().size() * 9 + inst.InstanceCount() * 8);
+        appendU32(dst, InstancedFlag | static_cast<std::uint32_t>(inst.Batches().size()));
+        for (const InstanceBatch& b : inst.Batches()) {
+            dst.push_back(static_cast<char>(b.op));
+            appendU32(dst, static_cast<std::uint32_t>(b.size));
+            appendU32(dst, b.count);
+            const Point* centers = inst.Centers(b);
+            for (std::uint32_t i = 0; i < b.count; ++i) {
+                appendU32(dst, static_cast<std::uint32_t>(centers[i].x));
+                appendU32(dst, static_cast<std::uint32_t>(centers[i].y));
+            }
+        }
+    }
+
+private:
+    static void appendU32(std::string& dst, std::uint32_t v) {
+        const char b[4] = { static_cast<char>(v), static_cast<char>(v >> 8),
+                            static_cast<char>(v >> 16), static_cast<char>(v >> 24) };
+        dst.append(b, 4);
+    }
+};
+
+// Компактный тег типа фигуры: сравнение целых чисел вместо строк
+enum class ShapeType : std::uint8_t {
+    Base,
+    Circle,
+    Square,
+    Count // число тегов, не тип фигуры
+};
+
+// Имя типа по тегу. Строки статические, выделения памяти нет
+inline std::string_view ShapeTypeName(ShapeType t) {
+    switch (t) {
+    case ShapeType::Circle:
+        return "Circle";
+    case ShapeType::Square:
+        return "Square";
+    default:
+        return "BaseFigure";
+    }
+}
+
+// Счётчики рисования DrwManager за время жизни менеджера (или с последнего resetDrawStats()).
+// Собираются по кадру и по выводу, а не по фигуре; при сборке с CP_TRPO_NO_DRAW_STATS остаются нулевыми
+struct DrawStats {
+#if defined(CP_TRPO_DRAW_STATS)
+    static constexpr bool Enabled = true;
+#else
+    static constexpr bool Enabled = false;
+#endif
+    static constexpr std::size_t TypeCount = static_cast<std::size_t>(ShapeType::Count);
+
+    std::uint64_t frames = 0;              // вызовы draw*
+    std::uint64_t shapes[TypeCount] = {};  // записанные команды по типам фигур
+    std::uint64_t nanos[TypeCount] = {};   // время записи команд по типам
+    std::uint64_t flushes = 0;             // непустые выводы приёмника
+    std::uint64_t bytes = 0;               // выведенные байты
+    std::uint64_t flushNanos = 0;          // время кодирования и вывода
+
+    std::uint64_t shapesOf(ShapeType t) const { return shapes[static_cast<std::size_t>(t)]; }
+    std::uint64_t nanosOf(ShapeType t) const { return nanos[static_cast<std::size_t>(t)]; }
+};
+
+// Базовый класс фигура
+class Shape {
+public:
+    // Здесь конструкторы, геттеры и сеттеры Get / Set
+    Shape(Point c, ShapeType t = ShapeType::Base) { center = c; type = t; }
+    virtual ~Shape() {} // Виртуальный деструктор для полиморфного удаления объектов
+
+    std::string_view GetType() const { return ShapeTypeName(type); }
+    ShapeType GetTypeTag() const { return type; }
+    Point GetCenter() const { return center; }
+    // Сеттеры объекта не отмечают фигуру для DrwManager::drawDirty(): учёт изменений есть только
+    // у сеттеров менеджера setCenter()/setSize() в режиме Packed
+    void SetCenter(Point c) { center = c; }
+
+    // Виртуальная функция рисования, будет переопределена в дочерних классах.
+    // Фигура только добавляет команду в буфер, вывод выполняет приёмник
+    virtual void Draw(CommandBuffer& buf) const = 0;
+
+    // Ограничивающий прямоугольник фигуры
+    virtual Rect GetBounds() const = 0;
+
+    // Немедленное рисование в std::cout, сохранено для совместимости
+    void Draw() const {
+        TextRenderSink sink(std::cout);
+        Draw(sink);
+        sink.Flush();
+    }
+
+protected:
+    Point center;
+    ShapeType type;
+};
+
+class Circle final : public Shape {
+public:
+    // Здесь конструкторы, геттеры и сеттеры Get / Set
+    static constexpr ShapeType Tag = ShapeType::Circle;
+
+    Circle(Point cnt, int r) : Shape(cnt, Tag) { radius = r; }
+
+    int GetRadius() const { return radius; }
+    void SetRadius(int v) { radius = v; }
+
+    using Shape::Draw;
+
+    void Draw(CommandBuffer& buf) const override {
+        DrawAt(buf, center, radius);
+    }
+
+    // Невиртуальное рисование по сырым данным, используется плотным хранилищем DrwManager
+    static void DrawAt(CommandBuffer& buf, Point c, int size) {
+        buf.Push(CommandAt(c, size));
+    }
+
+    static DrawCmd CommandAt(Point c, int size) { return DrawCmd{ DrawOp::Circle, c, size }; }
+
+    Rect GetBounds() const override { return BoundsAt(center, radius); }
+
+    // Отрицательный радиус даёт тот же прямоугольник, что и его модуль (SizeMagnitude)
+    static Rect BoundsAt(Point c, int size) {
+        const int r = SizeMagnitude(size);
+        return Rect{ c.x - r, c.y - r, c.x + r, c.y + r };
+    }
+
+private:
+    int radius;
+};
+
+class Square final : public Shape {
+public:
+    // Здесь конструкторы, геттеры и сеттеры Get / Set
+    static constexpr ShapeType Tag = ShapeType::Square;
+
+    Square(Point cnt, int r) : Shape(cnt, Tag) { side = r; }
+
+    int GetSide() const { return side; }
+    void SetSide(int v) { side = v; }
+
+    using Shape::Draw;
+
+    void Draw(CommandBuffer& buf) const override {
+        DrawAt(buf, center, side);
+    }
+
+    // Невиртуальное рисование по сырым данным, используется плотным хранилищем DrwManager
+    static void DrawAt(CommandBuffer& buf, Point c, int size) {
+        buf.Push(CommandAt(c, size));
+    }
+
+    static DrawCmd CommandAt(Point c, int size) { return DrawCmd{ DrawOp::Square, c, size }; }
+
+    Rect GetBounds() const override { return BoundsAt(center, side); }
+
+    // При отрицательной стороне края прямоугольника переставляются, чтобы minX <= maxX
+    static Rect BoundsAt(Point c, int size) {
+        const int minX = c.x - size / 2;
+        const int minY = c.y - size / 2;
+        if (size < 0)
+            return Rect{ minX + size, minY + size, minX, minY };
+        return Rect{ minX, minY, minX + size, minY + size };
+    }
+
+private:
+    int side;
+};
+
+// Раскладка фигур: в Itanium C++ ABI (GCC, Clang; не MSVC и clang-cl) размер производного класса лежит в хвостовом
+// выравнивании Shape, без лишних байт. MSVC хвост базового класса не переиспользует, там фигура на 8 байт больше;
+// настоящий размер показывает отчёт bench --footprint
+static_assert(sizeof(Point) == 8, "Point must stay two int32 coordinates");
+#if !defined(_MSC_VER)
+static_assert(sizeof(Circle) == sizeof(void*) + 16 && sizeof(Square) == sizeof(void*) + 16,
+              "Circle / Square must pack the size into Shape tail padding");
+#endif
+
+// Деструкторы фигур виртуальные, поэтому не тривиальные, но ничего не делают: арена не хранит
+// для таких объектов записей об уничтожении (16 байт на фигуру) и просто переиспользует их память
+template <class T>
+struct ArenaSkipsDestructor : std::false_type {};
+template <>
+struct ArenaSkipsDestructor<Circle> : std::true_type {};
+template <>
+struct ArenaSkipsDestructor<Square> : std::true_type {};
+
+// Арена для объектов фигур: память берётся крупными блоками, объекты размещаются подряд,
+// а вся сцена уничтожается одним вызовом reset(). Отдельного удаления объектов нет.
+// После reset() блоки остаются у арены и переиспользуются при построении следующей сцены
+class ShapeArena {
+public:
+    explicit ShapeArena(std::size_t blockSize = 64 * 1024) : blockBytes(blockSize) {}
+    ~ShapeArena() { reset(); }
+
+    ShapeArena(const ShapeArena&) = delete;
+    ShapeArena& operator=(const ShapeArena&) = delete;
+
+    template <class T, class... Args>
+    T* create(Args&&... args) {
+        void* mem = allocate(sizeof(T), alignof(T));
+        T* obj = new (mem) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value && !ArenaSkipsDestructor<T>::value)
+            dtors.push_back(DtorRecord{ obj, [](void* p) { static_cast<T*>(p)->~T(); } });
+        return obj;
+    }
+
+    // Уничтожает все объекты (в обратном порядке создания) и делает память доступной повторно
+    void reset() {
+        for (auto it = dtors.rbegin(); it != dtors.rend(); ++it)
+            it->destroy(it->object);
+        dtors.clear();
+        for (auto& block : blocks)
+            block.used = 0;
+        current = 0;
+    }
+
+    // Как reset(), но ещё и возвращает все блоки системе
+    void release() {
+        reset();
+        blocks.clear();
+    }
+
+    std::size_t bytesReserved() const {
+        std::size_t total = 0;
+        for (const auto& block : blocks)
+            total += block.size;
+        return total;
+    }
+
+    std::size_t bytesUsed() const {
+        std::size_t total = 0;
+        for (const auto& block : blocks)
+            total += block.used;
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+        std::size_t used;
+    };
+
+    struct DtorRecord {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    void* allocate(std::size_t size, std::size_t align) {
+        for (; current < blocks.size(); ++current) {
+            Block& block = blocks[current];
+            const std::size_t offset = (block.used + align - 1) / align * align;
+            if (offset + size <= block.size) {
+                block.used = offset + size;
+                return block.data.get() + offset;
+            }
+        }
+        // operator new[] выравнивает блок не хуже __STDCPP_DEFAULT_NEW_ALIGNMENT__, этого хватает для фигур
+        const std::size_t bytes = std::max(blockBytes, size);
+        blocks.push_back(Block{ std::unique_ptr<unsigned char[]>(new unsigned char[bytes]), bytes, size });
+        current = blocks.size() - 1;
+        return blocks.back().data.get();
+    }
+
+    std::size_t blockBytes;
+    std::vector<Block> blocks;
+    std::size_t current = 0;
+    std::vector<DtorRecord> dtors;
+};
+
+// Невладеющий указатель на объект в арене: копируется как обычный указатель, без счётчика ссылок.
+// Действителен до reset() арены
+template <class T>
+class ShapeRef {
+public:
+    ShapeRef(T* p = nullptr) : ptr(p) {}
+    template <class U>
+    ShapeRef(ShapeRef<U> other) : ptr(other.get()) {}
+
+    T* get() const { return ptr; }
+    T* operator->() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+private:
+    T* ptr;
+};
+
+// Столбцы одного типа фигур в виде структуры массивов (SoA): центры и размер (радиус / сторона)
+struct ShapeColumns {
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> size;
+
+    std::size_t count() const { return size.size(); }
+
+    void push(Point c, int s) {
+        x.push_back(c.x);
+        y.push_back(c.y);
+        size.push_back(s);
+    }
+
+    void reserve(std::size_t n) {
+        x.reserve(n);
+        y.reserve(n);
+        size.reserve(n);
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        size.clear();
+    }
+
+    void shrink() {
+        x.shrink_to_fit();
+        y.shrink_to_fit();
+        size.shrink_to_fit();
+    }
+
+    // Удаление перестановкой последнего элемента на место удаляемого
+    void swapRemove(std::size_t i) {
+        x[i] = x.back();
+        y[i] = y.back();
+        size[i] = size.back();
+        x.pop_back();
+        y.pop_back();
+        size.pop_back();
+    }
+};
+
+// Пакетные геометрические ядра над столбцами (SoA) x / y / size одного типа фигур.
+// При сборке с AVX2 (-mavx2) обрабатывается по 8 фигур за шаг, остаток и прочие платформы (в том числе ARM) -
+// скалярный вариант. Прямоугольники совпадают с Circle::BoundsAt / Square::BoundsAt.
+// Совпадение со скалярным вариантом проверяет SelfTest_GeometryKernelsMatchScalar (сборка CP_TRPO_SELFTEST).
+// Попадание в круг считается в double: результат точен, пока разности координат меньше 2^26
+
+// Индексы выбранных фигур плотного хранилища, по возрастанию внутри каждого типа
+struct ShapeSelection {
+    std::vector<std::uint32_t> squares;
+    std::vector<std::uint32_t> circles;
+
+    std::size_t size() const { return squares.size() + circles.size(); }
+    void clear() {
+        squares.clear();
+        circles.clear();
+    }
+    std::vector<std::uint32_t>& of(ShapeType t) { return t == ShapeType::Circle ? circles : squares; }
+};
+
+// Прямоугольники фигур в виде столбцов
+struct BoundsColumns {
+    std::vector<int> minX, minY, maxX, maxY;
+
+    void resize(std::size_t n) {
+        minX.resize(n);
+        minY.resize(n);
+        maxX.resize(n);
+        maxY.resize(n);
+    }
+};
+
+// Отрезок [lo, hi] всегда упорядочен, в том числе при отрицательном размере
+inline void ExtentAt(ShapeType t, int c, int size, int& lo, int& hi) {
+    if (t == ShapeType::Circle) {
+        const int r = SizeMagnitude(size);
+        lo = c - r;
+        hi = c + r;
+    }
+    else {
+        lo = c - size / 2;
+        hi = lo + size;
+        if (size < 0)
+            std::swap(lo, hi);
+    }
+}
+
+#if defined(__AVX2__)
+// Номер младшего единичного бита, mask != 0
+inline unsigned LowestSetBit(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long bit;
+    _BitScanForward(&bit, mask);
+    return static_cast<unsigned>(bit);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline void ExtentLanes(ShapeType t, __m256i c, __m256i size, __m256i& lo, __m256i& hi) {
+    if (t == ShapeType::Circle) {
+        // |INT_MIN| не помещается в int32: беззнаковый минимум сводит его к INT_MAX, как SizeMagnitude()
+        const __m256i r = _mm256_min_epu32(_mm256_abs_epi32(size), _mm256_set1_epi32(std::numeric_limits<int>::max()));
+        lo = _mm256_sub_epi32(c, r);
+        hi = _mm256_add_epi32(c, r);
+    }
+    else {
+        // size / 2 с округлением к нулю, как в скалярном варианте
+        const __m256i half = _mm256_srai_epi32(_mm256_add_epi32(size, _mm256_srli_epi32(size, 31)), 1);
+        const __m256i a = _mm256_sub_epi32(c, half);
+        const __m256i b = _mm256_add_epi32(a, size);
+        lo = _mm256_min_epi32(a, b);
+        hi = _mm256_max_epi32(a, b);
+    }
+}
+
+inline void PushMaskedIndices(unsigned mask, std::size_t base, std::vector<std::uint32_t>& out) {
+    while (mask) {
+        const unsigned bit = LowestSetBit(mask);
+        out.push_back(static_cast<std::uint32_t>(base + bit));
+        mask &= mask - 1;
+    }
+}
+#endif
+
+// Прямоугольники всех фигур столбцов
+inline void ComputeBoundsBatch(ShapeType t, const int* x, const int* y, const int* size, std::size_t n,
+                               int* minX, int* minY, int* maxX, int* maxY) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(size + i));
+        __m256i lo, hi;
+        ExtentLanes(t, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)), s, lo, hi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(minX + i), lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(maxX + i), hi);
+        ExtentLanes(t, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i)), s, lo, hi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(minY + i), lo);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(maxY + i), hi);
+    }
+#endif
+    for (; i < n; ++i) {
+        ExtentAt(t, x[i], size[i], minX[i], maxX[i]);
+        ExtentAt(t, y[i], size[i], minY[i], maxY[i]);
+    }
+}
+
+// Добавляет в out индексы фигур, чьи прямоугольники пересекают view
+inline void IntersectBatch(ShapeType t, const int* x, const int* y, const int* size, std::size_t n,
+                           const Rect& view, std::vector<std::uint32_t>& out) {
+    std::size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i vMinX = _mm256_set1_epi32(view.minX), vMaxX = _mm256_set1_epi32(view.maxX);
+    const __m256i vMinY = _mm256_set1_epi32(view.minY), vMaxY = _mm256_set1_epi32(view.maxY);
+    for (; i + 8 <= n; i += 8) {
+        const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(size + i));
+        __m256i x0, x1, y0, y1;
+        ExtentLanes(t, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(x + i)), s, x0, x1);
+        ExtentLanes(t, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(y + i)), s, y0, y1);
+        const __m256i outside = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(x0, vMaxX), _mm256_cmpgt_epi32(vMinX, x1)),
+            _mm256_or_si256(_mm256_cmpgt_epi32(y0, vMaxY), _mm256_cmpgt_epi32(vMinY, y1)));
+        const unsigned mask = ~static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(outside))) & 0xffu;
+        PushMaskedIndices(mask, i, out);
+    }
+#endif
+    for (; i < n; ++i) {
+        int x0, x1, y0, y1;
+        ExtentAt(t, x[i], size[i], x0, x1);
+        ExtentAt(t, y[i], size[i], y0, y1);
+        if (x0 <= view.maxX && view.minX <= x1 && y0 <= view.maxY && view.minY <= y1)
+            out.push_back(static_cast<std::uint32_t>(i));
+    }
+}
+
+// Попадание точки в прямоугольники фигур (для квадратов совпадает с попаданием в саму фигуру)
+inline void HitTestBoxes(ShapeType t, const int* x, const int* y, const int* size, std::size_t n,
+                         Point p, std::vector<std::uint32_t>& out) {
+    IntersectBatch(t, x, y, size, n, Rect{ p.x, p.y, p.x, p.y }, out);
+}
+
+// Добавляет в out индексы фигур, содержащих точку p (граница считается попаданием)
+inline void HitTestBatch(ShapeType t, const int* x, const int* y, const int* size, std::size_t n,
+                         Point p, std::vector<std::uint32_t>& out) {
+    std::size_t i = 0;
+    if (t == ShapeType::Circle) {
+        const double px = p.x, py = p.y;
+#if defined(__AVX2__)
+        const __m256d vpx = _mm256_set1_pd(px), vpy = _mm256_set1_pd(py);
+        for (; i + 4 <= n; i += 4) {
+            const __m256d dx = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i))), vpx);
+            const __m256d dy = _mm256_sub_pd(_mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + i))), vpy);
+            const __m256d r = _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(size + i)));
+            const __m256d d2 = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+            const unsigned mask = static_cast<unsigned>(_mm256_movemask_pd(_mm256_cmp_pd(d2, _mm256_mul_pd(r, r), _CMP_LE_OQ)));
+            PushMaskedIndices(mask, i, out);
+        }
+#endif
+        for (; i < n; ++i) {
+            const double dx = x[i] - px, dy = y[i] - py, r = size[i];
+            if (dx * dx + dy * dy <= r * r)
+                out.push_back(static_cast<std::uint32_t>(i));
+        }
+        return;
+    }
+    HitTestBoxes(t, x, y, size, n, p, out);
+}
+
+// Изменённые с прошлого кадра индексы одного типа: флаги для проверки и список для обхода
+struct DirtySet {
+    std::vector<std::uint8_t> flags;
+    std::vector<std::uint32_t> list;
+
+    void mark(std::size_t i) {
+        if (i >= flags.size())
+            flags.resize(i + 1, 0);
+        if (!flags[i]) {
+            flags[i] = 1;
+            list.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+
+    // Повторяет перестановку ShapeColumns::swapRemove: на месте i теперь другая фигура
+    void swapRemove(std::size_t i, std::size_t count) {
+        if (flags.size() > count)
+            flags.resize(count);
+        if (i < count)
+            mark(i);
+    }
+
+    void clear() {
+        for (std::uint32_t i : list)
+            if (i < flags.size())
+                flags[i] = 0;
+        list.clear();
+    }
+
+    void reset() {
+        flags.clear();
+        list.clear();
+    }
+};
+
+// Равномерная сетка над ограничивающими прямоугольниками фигур плотного хранилища.
+// Фигура заносится во все ячейки, которые пересекает её прямоугольник; ключ фигуры - (тип, индекс в столбцах).
+// Фигура больше чем на MaxCellsPerShape ячеек в сетку не раскладывается, а лежит в общем списке
+// крупных фигур, который проверяется при каждом запросе
+class SpatialGrid {
+public:
+    static constexpr std::uint64_t MaxCellsPerShape = 1024;
+
+    explicit SpatialGrid(int cell = 64) : cellSize(cell > 0 ? cell : 1) {}
+
+    int getCellSize() const { return cellSize; }
+
+    void insert(ShapeType t, std::uint32_t index, const Rect& box) {
+        if (isOversized(box)) {
+            oversized.push_back(Entry{ box, index, t });
+            return;
+        }
+        if (box.minX > box.maxX || box.minY > box.maxY)
+            return;
+        if (cells.empty()) {
+            occMinX = cellOf(box.minX);
+            occMinY = cellOf(box.minY);
+            occMaxX = cellOf(box.maxX);
+            occMaxY = cellOf(box.maxY);
+        }
+        else {
+            occMinX = std::min(occMinX, cellOf(box.minX));
+            occMinY = std::min(occMinY, cellOf(box.minY));
+            occMaxX = std::max(occMaxX, cellOf(box.maxX));
+            occMaxY = std::max(occMaxY, cellOf(box.maxY));
+        }
+        forCells(box, [&](std::uint64_t key) { cells[key].push_back(Entry{ box, index, t }); });
+    }
+
+    void erase(ShapeType t, std::uint32_t index, const Rect& box) {
+        if (isOversized(box)) {
+            for (std::size_t k = 0; k < oversized.size(); ++k) {
+                if (oversized[k].index == index && oversized[k].type == t) {
+                    oversized[k] = oversized.back();
+                    oversized.pop_back();
+                    break;
+                }
+            }
+            return;
+        }
+        forCells(box, [&](std::uint64_t key) {
+            auto it = cells.find(key);
+            if (it == cells.end())
+                return;
+            std::vector<Entry>& entries = it->second;
+            for (std::size_t k = 0; k < entries.size(); ++k) {
+                if (entries[k].index == index && entries[k].type == t) {
+                    entries[k] = entries.back();
+                    entries.pop_back();
+                    break;
+                }
+            }
+            if (entries.empty())
+                cells.erase(it);
+        });
+    }
+
+    // Меняет индекс фигуры после перестановки при удалении из столбцов
+    void renumber(ShapeType t, std::uint32_t from, std::uint32_t to, const Rect& box) {
+        if (isOversized(box)) {
+            for (Entry& e : oversized) {
+                if (e.index == from && e.type == t) {
+                    e.index = to;
+                    break;
+                }
+            }
+            return;
+        }
+        forCells(box, [&](std::uint64_t key) {
+            auto it = cells.find(key);
+            if (it == cells.end())
+                return;
+            for (Entry& e : it->second) {
+                if (e.index == from && e.type == t) {
+                    e.index = to;
+                    break;
+                }
+            }
+        });
+    }
+
+    void clear() {
+        cells.clear();
+        oversized.clear();
+    }
+
+    std::size_t oversizedCount() const { return oversized.size(); }
+
+    // Вызывает f(тип, индекс) ровно один раз для каждой фигуры, пересекающей view.
+    // Фигура из нескольких ячеек сообщается только из первой ячейки общего с view прямоугольника
+    template <class F>
+    void query(const Rect& view, F f) const {
+        for (const Entry& e : oversized)
+            if (e.box.Intersects(view))
+                f(e.type, e.index);
+        if (cells.empty())
+            return;
+        // Окно обрезается по занятой части сетки: за её пределами ячеек нет, а произведение сторон
+        // необрезанного окна может не поместиться в 64 бита
+        const int vx0 = std::max(cellOf(view.minX), occMinX), vy0 = std::max(cellOf(view.minY), occMinY);
+        const int vx1 = std::min(cellOf(view.maxX), occMaxX), vy1 = std::min(cellOf(view.maxY), occMaxY);
+        if (vx0 > vx1 || vy0 > vy1)
+            return;
+        auto visit = [&](int cx, int cy, const std::vector<Entry>& entries) {
+            for (const Entry& e : entries) {
+                if (!e.box.Intersects(view))
+                    continue;
+                if (cx != std::max(vx0, cellOf(e.box.minX)) || cy != std::max(vy0, cellOf(e.box.minY)))
+                    continue;
+                f(e.type, e.index);
+            }
+        };
+        const std::uint64_t w = std::uint64_t(std::int64_t(vx1) - vx0 + 1);
+        const std::uint64_t h = std::uint64_t(std::int64_t(vy1) - vy0 + 1);
+        if (h > cells.size() / w) {
+            // Окно больше числа занятых ячеек (w * h > cells.size()): дешевле пройти по непустым ячейкам
+            for (const auto& cell : cells) {
+                const int cx = static_cast<std::int32_t>(cell.first >> 32);
+                const int cy = static_cast<std::int32_t>(cell.first & 0xffffffffu);
+                if (cx >= vx0 && cx <= vx1 && cy >= vy0 && cy <= vy1)
+                    visit(cx, cy, cell.second);
+            }
+            return;
+        }
+        for (std::int64_t cy = vy0; cy <= vy1; ++cy) {
+            for (std::int64_t cx = vx0; cx <= vx1; ++cx) {
+                auto it = cells.find(keyOf(int(cx), int(cy)));
+                if (it != cells.end())
+                    visit(int(cx), int(cy), it->second);
+            }
+        }
+    }
+
+private:
+    struct Entry {
+        Rect box;
+        std::uint32_t index;
+        ShapeType type;
+    };
+
+    int cellOf(int v) const {
+        // Деление с округлением вниз, чтобы отрицательные координаты попадали в свои ячейки
+        return v >= 0 ? v / cellSize : -((-(v + 1)) / cellSize) - 1;
+    }
+
+    static std::uint64_t keyOf(int cx, int cy) {
+        return (std::uint64_t(std::uint32_t(cx)) << 32) | std::uint32_t(cy);
+    }
+
+    // Зависит только от прямоугольника, поэтому erase() и renumber() находят фигуру там же, куда её положил insert()
+    bool isOversized(const Rect& box) const {
+        if (box.minX > box.maxX || box.minY > box.maxY)
+            return false;
+        const std::uint64_t w = std::uint64_t(std::int64_t(cellOf(box.maxX)) - cellOf(box.minX) + 1);
+        const std::uint64_t h = std::uint64_t(std::int64_t(cellOf(box.maxY)) - cellOf(box.minY) + 1);
+        return w > MaxCellsPerShape || h > MaxCellsPerShape / w;
+    }
+
+    template <class F>
+    void forCells(const Rect& box, F f) {
+        for (std::int64_t cy = cellOf(box.minY); cy <= cellOf(box.maxY); ++cy)
+            for (std::int64_t cx = cellOf(box.minX); cx <= cellOf(box.maxX); ++cx)
+                f(keyOf(int(cx), int(cy)));
+    }
+
+    int cellSize;
+    std::unordered_map<std::uint64_t, std::vector<Entry>> cells;
+    std::vector<Entry> oversized;
+    // Занятая часть сетки в ячейках; после удалений только охватывает её, при пустой сетке не используется
+    int occMinX = 0, occMinY = 0, occMaxX = 0, occMaxY = 0;
+};
+
+// Пул потоков с перехватом задач (work stealing).
+// У каждого участника своя очередь индексов задач: свои задачи берутся с конца очереди,
+// а освободившийся поток забирает задачи с начала чужих очередей.
+// Вызывающий run() поток тоже выполняет задачи. Одновременно выполняется только один run()
+class WorkStealingPool {
+public:
+    // threads - общее число участников вместе с вызывающим потоком, 0 - по числу ядер
+    explicit WorkStealingPool(unsigned threads = 0) {
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; ++i)
+            queues.emplace_back(new TaskQueue());
+        for (unsigned i = 0; i + 1 < threads; ++i)
+            workers.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : workers)
+            t.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    unsigned threadCount() const { return static_cast<unsigned>(queues.size()); }
+
+    // Выполняет task(i) для всех i из [0, count) и возвращается после завершения всех задач.
+    // Первое исключение из задач пробрасывается вызывающему
+    void run(std::size_t count, const std::function<void(std::size_t)>& task) {
+        if (count == 0)
+            return;
+        std::lock_guard<std::mutex> runLock(runMutex);
+
+        // Раздаём задачи непрерывными блоками, чтобы соседние куски обрабатывал один поток
+        const std::size_t q = queues.size();
+        for (std::size_t i = 0; i < q; ++i) {
+            std::lock_guard<std::mutex> lock(queues[i]->m);
+            for (std::size_t t = count * i / q; t < count * (i + 1) / q; ++t)
+                queues[i]->items.push_back(t);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            job = &task;
+            remaining = count;
+            error = nullptr;
+            ++generation;
+        }
+        wake.notify_all();
+
+        drain(static_cast<unsigned>(q - 1), task);
+
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [this] { return remaining == 0 && active == 0; });
+        job = nullptr;
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+private:
+    struct TaskQueue {
+        std::mutex m;
+        std::deque<std::size_t> items;
+    };
+
+    void workerLoop(unsigned id) {
+        std::size_t seen = 0;
+        for (;;) {
+            const std::function<void(std::size_t)>* current;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping)
+                    return;
+                seen = generation;
+                current = job;
+                if (!current)
+                    continue; // проснулись после завершения run(): все задачи уже выполнены другими
+                ++active;
+            }
+            drain(id, *current);
+            {
+                std::lock_guard<std::mutex> lock(m);
+                --active;
+            }
+            done.notify_all();
+        }
+    }
+
+    void drain(unsigned id, const std::function<void(std::size_t)>& task) {
+        std::size_t t;
+        while (popLocal(id, t) || steal(id, t)) {
+            try {
+                task(t);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m);
+                if (!error)
+                    error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(m);
+            if (--remaining == 0)
+                done.notify_all();
+        }
+    }
+
+    bool popLocal(unsigned id, std::size_t& t) {
+        TaskQueue& queue = *queues[id];
+        std::lock_guard<std::mutex> lock(queue.m);
+        if (queue.items.empty())
+            return false;
+        t = queue.items.back();
+        queue.items.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned thief, std::size_t& t) {
+        const std::size_t q = queues.size();
+        for (std::size_t k = 1; k < q; ++k) {
+            TaskQueue& victim = *queues[(thief + k) % q];
+            std::lock_guard<std::mutex> lock(victim.m);
+            if (!victim.items.empty()) {
+                t = victim.items.front();
+                victim.items.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<TaskQueue>> queues; // последняя очередь принадлежит вызывающему потоку
+    std::vector<std::thread> workers;
+
+    std::mutex runMutex;
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(std::size_t)>* job = nullptr;
+    std::size_t generation = 0;
+    std::size_t remaining = 0;
+    unsigned active = 0;
+    std::exception_ptr error;
+    bool stopping = false;
+};
+
+class FramePipeline;
+
+// Метка отправленного кадра: по ней вызывающий узнаёт, что кадр выведен и его буфер свободен
+class FrameFence {
+public:
+    FrameFence() = default;
+
+    bool ready() const;
+    // Ждёт вывода кадра; ошибка вывода пробрасывается вызывающему
+    void wait() const;
+    std::uint64_t frame() const { return number; }
+
+private:
+    friend class FramePipeline;
+    FrameFence(const FramePipeline* p, std::uint64_t n) : pipeline(p), number(n) {}
+
+    const FramePipeline* pipeline = nullptr;
+    std::uint64_t number = 0;
+};
+
+// Конвейер кадров с двойной буферизацией: вызывающий записывает кадр N+1 в один буфер команд,
+// пока фоновый поток выводит кадр N из другого в приёмник. Пока конвейер существует,
+// приёмник используется только его потоком
+class FramePipeline {
+public:
+    explicit FramePipeline(RenderSink& target) : sink(target), flusher(&FramePipeline::flushLoop, this) {}
+
+    ~FramePipeline() {
+        {
+            std::unique_lock<std::mutex> lock(m);
+            idle.wait(lock, [this] { return completed == submitted; });
+            stopping = true;
+        }
+        work.notify_all();
+        flusher.join();
+    }
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // Буфер для записи следующего кадра, уже очищенный. Если буфер ещё выводится (кадр N-1),
+    // ждёт его вывода. Каждому acquire() соответствует один submit()
+    CommandBuffer& acquire() {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [this] { return completed + 1 >= submitted; });
+        rethrowLocked();
+        CommandBuffer& buf = buffers[submitted % 2];
+        buf.Clear();
+        return buf;
+    }
+
+    // Отдаёт записанный буфер фоновому потоку и сразу возвращается
+    FrameFence submit() {
+        std::uint64_t frame;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            frame = submitted++;
+        }
+        work.notify_one();
+        return FrameFence(this, frame);
+    }
+
+    // Ждёт вывода всех отправленных кадров
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [this] { return completed == submitted; });
+        rethrowLocked();
+    }
+
+    std::uint64_t submittedFrames() const {
+        std::lock_guard<std::mutex> lock(m);
+        return submitted;
+    }
+
+    std::uint64_t completedFrames() const {
+        std::lock_guard<std::mutex> lock(m);
+        return completed;
+    }
+
+private:
+    friend class FrameFence;
+
+    bool isDone(std::uint64_t frame) const {
+        std::lock_guard<std::mutex> lock(m);
+        return completed > frame;
+    }
+
+    void waitFor(std::uint64_t frame) const {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [&] { return completed > frame; });
+        rethrowLocked();
+    }
+
+    // Первая ошибка вывода отдаётся один раз, следующий вызов уже не бросает
+    void rethrowLocked() const {
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    void flushLoop() {
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+            work.wait(lock, [this] { return stopping || completed < submitted; });
+            if (completed == submitted)
+                return; // stopping
+            const CommandBuffer& buf = buffers[completed % 2];
+            lock.unlock();
+            std::exception_ptr failure;
+            try {
+                sink.FlushBuffer(buf);
+            }
+            catch (...) {
+                failure = std::current_exception();
+            }
+            lock.lock();
+            if (failure && !error)
+                error = failure;
+            ++completed;
+            idle.notify_all();
+        }
+    }
+
+    RenderSink& sink;
+    CommandBuffer buffers[2];
+    mutable std::mutex m;
+    mutable std::condition_variable idle; // кадр выведен
+    std::condition_variable work;         // отправлен новый кадр или остановка
+    std::uint64_t submitted = 0;
+    std::uint64_t completed = 0;
+    mutable std::exception_ptr error;
+    bool stopping = false;
+    std::thread flusher; // последним: поток стартует, когда остальные члены уже созданы
+};
+
+inline bool FrameFence::ready() const { return !pipeline || pipeline->isDone(number); }
+
+inline void FrameFence::wait() const {
+    if (pipeline)
+        pipeline->waitFor(number);
+}
+
+// Фигура как значение из закрытого набора типов. Хранится в векторе без отдельного выделения памяти,
+// рисуется через посетителя: тип известен статически, тело Draw() встраивается
+using ShapeValue = std::variant<Circle, Square>;
+
+inline void DrawValue(const ShapeValue& shape, CommandBuffer& buf) {
+    std::visit([&buf](const auto& s) { s.Draw(buf); }, shape);
+}
+
+// Запись файла сцены: тег типа, центр и размер фигуры. Файл - заголовок SceneHeader и плотный массив записей,
+// все поля little-endian (как у BinaryRenderSink) и выровнены, поэтому отображённый файл читается без разбора
+struct SceneRecord {
+    std::int32_t x;
+    std::int32_t y;
+    std::int32_t size;
+    std::uint8_t type; // ShapeType
+    std::uint8_t reserved[3];
+};
+static_assert(sizeof(SceneRecord) == 16, "SceneRecord must stay a 16-byte on-disk record");
+
+struct SceneHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t count;
+};
+static_assert(sizeof(SceneHeader) == 16, "SceneHeader must keep records 16-byte aligned");
+
+// constexpr: сцены из известных при компиляции фигур собираются в std::array<SceneRecord, N>
+// и попадают в данные только для чтения, см. DrwManager::loadStaticScene()
+constexpr SceneRecord MakeSceneRecord(ShapeType t, Point c, int size) {
+    SceneRecord r = {};
+    r.x = c.x;
+    r.y = c.y;
+    r.size = size;
+    r.type = static_cast<std::uint8_t>(t);
+    return r;
+}
+
+// Файл сцены, открытый только для чтения. Где есть mmap, файл отображается в память и записи
+// используются прямо из страниц файла; иначе файл читается в буфер одним вызовом.
+// На big-endian процессоре файл всегда читается в буфер, и записи переводятся в порядок байт процессора
+class SceneFile {
+public:
+    static constexpr char Magic[4] = { 'C', 'P', 'S', 'C' };
+    static const std::uint32_t Version = 1;
+
+    SceneFile() = default;
+    ~SceneFile() { close(); }
+
+    SceneFile(const SceneFile&) = delete;
+    SceneFile& operator=(const SceneFile&) = delete;
+
+    // false, если файл не открылся, короче заголовка или его размер не равен заголовку и header.count записям
+    bool open(const std::string& path) {
+        close();
+#if defined(CP_TRPO_HAS_MMAP) && !defined(CP_TRPO_BIG_ENDIAN)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(SceneHeader))) {
+            void* p = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                mappedSize = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+        if (mapped)
+            return attach(static_cast<const char*>(mapped), mappedSize);
+#endif
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in)
+            return false;
+        const std::streamoff size = in.tellg();
+        if (size < static_cast<std::streamoff>(sizeof(SceneHeader)))
+            return false;
+        // Буфер из записей, чтобы данные после заголовка были выровнены так же, как в отображённом файле
+        buffer.resize((static_cast<std::size_t>(size) + sizeof(SceneRecord) - 1) / sizeof(SceneRecord));
+        in.seekg(0);
+        if (!in.read(reinterpret_cast<char*>(buffer.data()), size))
+            return false;
+        if (!attach(reinterpret_cast<const char*>(buffer.data()), static_cast<std::size_t>(size)))
+            return false;
+        convertByteOrder(buffer.data() + 1, n); // buffer[0] - заголовок того же размера, что и запись
+        return true;
+    }
+
+    void close() {
+#if defined(CP_TRPO_HAS_MMAP)
+        if (mapped)
+            munmap(mapped, mappedSize);
+#endif
+        mapped = nullptr;
+        mappedSize = 0;
+        buffer.clear();
+        recs = nullptr;
+        n = 0;
+    }
+
+    const SceneRecord* records() const { return recs; }
+    std::size_t count() const { return n; }
+    bool isMapped() const { return mapped != nullptr; }
+
+    static bool write(const std::string& path, const SceneRecord* records, std::size_t count) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        SceneHeader header;
+        std::memcpy(header.magic, Magic, sizeof(Magic));
+        header.version = Version;
+        header.count = count;
+        convertByteOrder(header);
+#if defined(CP_TRPO_BIG_ENDIAN)
+        std::vector<SceneRecord> little(records, records + count);
+        convertByteOrder(little.data(), count);
+        records = little.data();
+#endif
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(records), static_cast<std::streamsize>(count * sizeof(SceneRecord)));
+        return static_cast<bool>(out.flush());
+    }
+
+    static bool validHeader(const SceneHeader& header) {
+        return std::memcmp(header.magic, Magic, sizeof(Magic)) == 0 && header.version == Version;
+    }
+
+    // Перевод между порядком байт файла (little-endian) и процессора, в обе стороны; на little-endian ничего не делает
+    static void convertByteOrder(SceneHeader& header) {
+#if defined(CP_TRPO_BIG_ENDIAN)
+        header.version = __builtin_bswap32(header.version);
+        header.count = __builtin_bswap64(header.count);
+#else
+        (void)header;
+#endif
+    }
+
+    static void convertByteOrder(SceneRecord* records, std::size_t count) {
+#if defined(CP_TRPO_BIG_ENDIAN)
+        auto swap = [](std::int32_t v) { return static_cast<std::int32_t>(__builtin_bswap32(static_cast<std::uint32_t>(v))); };
+        for (std::size_t i = 0; i < count; ++i) {
+            records[i].x = swap(records[i].x);
+            records[i].y = swap(records[i].y);
+            records[i].size = swap(records[i].size);
+        }
+#else
+        (void)records;
+        (void)count;
+#endif
+    }
+
+private:
+    bool attach(const char* data, std::size_t size) {
+        SceneHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        convertByteOrder(header);
+        // Размер файла - ровно заголовок и header.count записей: без обрезанных и лишних байт в конце
+        const std::uint64_t maxCount = (UINT64_MAX - sizeof(SceneHeader)) / sizeof(SceneRecord);
+        if (!validHeader(header) || header.count > maxCount ||
+            size != sizeof(SceneHeader) + header.count * sizeof(SceneRecord)) {
+            close();
+            return false;
+        }
+        recs = reinterpret_cast<const SceneRecord*>(data + sizeof(SceneHeader));
+        n = static_cast<std::size_t>(header.count);
+        return true;
+    }
+
+    void* mapped = nullptr;
+    std::size_t mappedSize = 0;
+    std::vector<SceneRecord> buffer; // запасной путь без mmap
+    const SceneRecord* recs = nullptr;
+    std::size_t n = 0;
+};
+
+// Способ хранения фигур в DrwManager
+enum class StorageMode {
+    List,   // список умных указателей на Shape, рисование через виртуальный Draw()
+    Packed, // отдельные плотные массивы для каждого типа, рисование без виртуальных вызовов
+    Arena,  // объекты Shape в арене сцены, массив невладеющих ссылок, рисование через виртуальный Draw()
+    Variant, // значения ShapeValue в одном векторе, рисование через std::visit без виртуальных вызовов
+    Mapped   // записи файла сцены, отображённого в память, рисуются прямо из файла; добавленные фигуры - после них
+};
+
+// Устойчивая ссылка на фигуру плотного хранилища (режим Packed): номер ячейки таблицы и её поколение.
+// Переживает перестановки при удалении других фигур; после удаления своей фигуры становится недействительной
+struct ShapeHandle {
+    std::uint32_t slot = UINT32_MAX;
+    std::uint32_t generation = 0;
+
+    bool isNull() const { return slot == UINT32_MAX; }
+    bool operator==(const ShapeHandle& o) const { return slot == o.slot && generation == o.generation; }
+    bool operator!=(const ShapeHandle& o) const { return !(*this == o); }
+};
+
+// Код изменения ячейки в дельте сцены
+enum class DeltaOp : std::uint8_t {
+    Add = 1,    // фигура появилась в ячейке (или заменила прежнюю): тип, центр, размер
+    Remove = 2, // ячейка опустела
+    Move = 3,   // новый центр
+    Resize = 4  // новый размер
+};
+
+// Изменение одной фигуры; для Remove / Move / Resize значимы только нужные поля
+struct ShapeChange {
+    DeltaOp op;
+    ShapeType type;
+    ShapeHandle handle;
+    Point center;
+    int size;
+};
+
+// Дельта между двумя версиями сцены: изменения фигур по устойчивым ссылкам.
+// Двоичный формат (little-endian, как у BinaryRenderSink): "CPSD", uint32 флаги (бит 0 - сброс сцены),
+// uint64 исходная и новая версии, uint32 число изменений; изменение - uint8 код и uint32 ячейка, затем
+// Add: uint32 поколение, uint8 тип, int32 x, y, размер; Move: int32 x, y; Resize: int32 размер
+struct SceneDelta {
+    static constexpr char Magic[4] = { 'C', 'P', 'S', 'D' };
+    static const std::uint32_t ResetFlag = 1;
+
+    bool reset = false; // зритель сначала очищает сцену
+    std::uint64_t fromVersion = 0;
+    std::uint64_t toVersion = 0;
+    std::vector<ShapeChange> changes;
+
+    void encode(std::string& dst) const {
+        dst.reserve(dst.size() + 28 + changes.size() * 22);
+        dst.append(Magic, sizeof(Magic));
+        appendU32(dst, reset ? ResetFlag : 0);
+        appendU64(dst, fromVersion);
+        appendU64(dst, toVersion);
+        appendU32(dst, static_cast<std::uint32_t>(changes.size()));
+        for (const ShapeChange& c : changes) {
+            dst.push_back(static_cast<char>(c.op));
+            appendU32(dst, c.handle.slot);
+            switch (c.op) {
+            case DeltaOp::Add:
+                appendU32(dst, c.handle.generation);
+                dst.push_back(static_cast<char>(c.type));
+                appendU32(dst, static_cast<std::uint32_t>(c.center.x));
+                appendU32(dst, static_cast<std::uint32_t>(c.center.y));
+                appendU32(dst, static_cast<std::uint32_t>(c.size));
+                break;
+            case DeltaOp::Move:
+                appendU32(dst, static_cast<std::uint32_t>(c.center.x));
+                appendU32(dst, static_cast<std::uint32_t>(c.center.y));
+                break;
+            case DeltaOp::Resize:
+                appendU32(dst, static_cast<std::uint32_t>(c.size));
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // Разбирает дельту; false, если данные обрезаны или повреждены (содержимое дельты при этом не определено)
+    bool decode(const char* data, std::size_t n) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        const unsigned char* end = p + n;
+        std::uint32_t flags, count;
+        if (n < 28 || std::memcmp(p, Magic, sizeof(Magic)) != 0)
+            return false;
+        p += sizeof(Magic);
+        flags = readU32(p);
+        fromVersion = readU64(p);
+        toVersion = readU64(p);
+        count = readU32(p);
+        reset = (flags & ResetFlag) != 0;
+        changes.clear();
+        for (std::uint32_t i = 0; i < count; ++i) {
+            if (end - p < 5)
+                return false;
+            ShapeChange c = {};
+            c.op = static_cast<DeltaOp>(*p++);
+            c.handle.slot = readU32(p);
+            const std::ptrdiff_t need = c.op == DeltaOp::Add ? 17 : c.op == DeltaOp::Move ? 8 : c.op == DeltaOp::Resize ? 4 : 0;
+            if ((c.op < DeltaOp::Add || c.op > DeltaOp::Resize) || end - p < need)
+                return false;
+            if (c.op == DeltaOp::Add) {
+                c.handle.generation = readU32(p);
+                c.type = static_cast<ShapeType>(*p++);
+                if (c.type != ShapeType::Circle && c.type != ShapeType::Square)
+                    return false;
+            }
+            if (c.op == DeltaOp::Add || c.op == DeltaOp::Move) {
+                c.center.x = static_cast<std::int32_t>(readU32(p));
+                c.center.y = static_cast<std::int32_t>(readU32(p));
+            }
+            if (c.op == DeltaOp::Add || c.op == DeltaOp::Resize)
+                c.size = static_cast<std::int32_t>(readU32(p));
+            changes.push_back(c);
+        }
+        return p == end;
+    }
+
+private:
+    static void appendU32(std::string& dst, std::uint32_t v) {
+        const char b[4] = { static_cast<char>(v), static_cast<char>(v >> 8),
+                            static_cast<char>(v >> 16), static_cast<char>(v >> 24) };
+        dst.append(b, 4);
+    }
+    static void appendU64(std::string& dst, std::uint64_t v) {
+        appendU32(dst, static_cast<std::uint32_t>(v));
+        appendU32(dst, static_cast<std::uint32_t>(v >> 32));
+    }
+    static std::uint32_t readU32(const unsigned char*& p) {
+        const std::uint32_t v = std::uint32_t(p[0]) | std::uint32_t(p[1]) << 8 | std::uint32_t(p[2]) << 16 |
+                                std::uint32_t(p[3]) << 24;
+        p += 4;
+        return v;
+    }
+    static std::uint64_t readU64(const unsigned char*& p) {
+        const std::uint64_t lo = readU32(p);
+        return lo | std::uint64_t(readU32(p)) << 32;
+    }
+};
+
+// Сцена на стороне зрителя, собранная из дельт DrwManager::takeDelta(): плотный массив записей
+// и разреженное отображение ячейка -> запись. Дельта применяется на месте за время, пропорциональное числу
+// изменений, а не размеру сцены. Порядок рисования может отличаться от порядка у DrwManager.
+// Память реплики растёт с числом записей, а не с номерами ячеек: ячейка 2^32 - 1 из повреждённых
+// или чужих данных стоит одной записи
+class SceneReplica {
+public:
+    // Применяет дельту, продолжающую текущую версию (или сбрасывающую сцену).
+    // Иначе возвращает false, реплика не меняется; изменения пустых ячеек пропускаются
+    bool apply(const SceneDelta& d) {
+        if (!d.reset && d.fromVersion != ver)
+            return false;
+        if (d.reset) {
+            recs.clear();
+            recSlots.clear();
+            slotIndex.clear();
+        }
+        for (const ShapeChange& c : d.changes) {
+            const std::uint32_t slot = c.handle.slot;
+            if (c.op == DeltaOp::Add) {
+                const SceneRecord r = MakeSceneRecord(c.type, c.center, c.size);
+                const auto found = slotIndex.find(slot);
+                if (found != slotIndex.end()) {
+                    recs[found->second] = r;
+                }
+                else {
+                    slotIndex.emplace(slot, static_cast<std::uint32_t>(recs.size()));
+                    recs.push_back(r);
+                    recSlots.push_back(slot);
+                }
+                continue;
+            }
+            const auto found = slotIndex.find(slot);
+            if (found == slotIndex.end())
+                continue;
+            const std::uint32_t i = found->second;
+            if (c.op == DeltaOp::Move) {
+                recs[i].x = c.center.x;
+                recs[i].y = c.center.y;
+            }
+            else if (c.op == DeltaOp::Resize) {
+                recs[i].size = c.size;
+            }
+            else {
+                // Удаление перестановкой последней записи на место удалённой
+                recs[i] = recs.back();
+                recSlots[i] = recSlots.back();
+                slotIndex.erase(found);
+                if (recSlots[i] != slot)
+                    slotIndex[recSlots[i]] = i;
+                recs.pop_back();
+                recSlots.pop_back();
+            }
+        }
+        ver = d.toVersion;
+        return true;
+    }
+
+    // Применяет закодированную дельту; false при повреждённых данных или несовпадении версии
+    bool apply(const char* data, std::size_t n) {
+        return scratch.decode(data, n) && apply(scratch);
+    }
+
+    std::uint64_t version() const { return ver; }
+    std::size_t count() const { return recs.size(); }
+    const std::vector<SceneRecord>& records() const { return recs; }
+
+    bool contains(std::uint32_t slot) const { return slotIndex.count(slot) != 0; }
+    const SceneRecord* find(std::uint32_t slot) const {
+        const auto found = slotIndex.find(slot);
+        return found != slotIndex.end() ? &recs[found->second] : nullptr;
+    }
+
+    // Рисует реплику одним кадром
+    void draw(RenderSink& sink) const {
+        for (const SceneRecord& r : recs) {
+            const Point c(r.x, r.y);
+            sink.Push(r.type == static_cast<std::uint8_t>(ShapeType::Circle) ? Circle::CommandAt(c, r.size)
+                                                                             : Square::CommandAt(c, r.size));
+        }
+        sink.Flush();
+    }
+
+private:
+    std::vector<SceneRecord> recs;
+    std::vector<std::uint32_t> recSlots;  // запись -> ячейка
+    std::unordered_map<std::uint32_t, std::uint32_t> slotIndex; // ячейка -> номер записи, только занятые
+    std::uint64_t ver = 0;
+    SceneDelta scratch; // буфер разбора apply(data, n), переиспользуется
+};
+
+// Настройки рисования с уровнем детализации drawShapes(scale). Размеры - в пикселях экрана
+struct LodOptions {
+    double minScreenSize = 2.0;  // фигуры с экранным размером меньше порога считаются мелкими
+    bool mergeSmall = true;      // мелкие фигуры сливаются в метки ячеек, иначе рисуются точками
+    double cellScreenSize = 8.0; // сторона ячейки слияния
+};
+
+// Ячейка слияния LOD: номера по обеим осям целиком. При крупном масштабе номер не помещается в 32 бита,
+// и ключ из двух усечённых половин склеивал бы разные ячейки
+struct LodCell {
+    std::int64_t x;
+    std::int64_t y;
+
+    bool operator==(const LodCell& o) const { return x == o.x && y == o.y; }
+    bool operator!=(const LodCell& o) const { return !(*this == o); }
+};
+
+struct LodCellHash {
+    std::size_t operator()(const LodCell& c) const {
+        return std::hash<std::uint64_t>()(static_cast<std::uint64_t>(c.x) * 0x9e3779b97f4a7c15ull ^ static_cast<std::uint64_t>(c.y));
+    }
+};
+
+class DrwManager {
+private:
+    StorageMode mode;
+    std::list<std::shared_ptr<Shape>> shapeList; // Используем умные указатели для управления памятью объектов
+
+    // Плотное хранилище для режима StorageMode::Packed.
+    // Порядок вставки сохраняется только внутри одного типа: сначала рисуются все квадраты, затем все круги.
+    ShapeColumns squares;
+    ShapeColumns circles;
+
+    // Таблица устойчивых ссылок ShapeHandle режима Packed: ячейка -> (тип, индекс в столбцах),
+    // для столбцов - обратное отображение индекс -> ячейка. Свободные ячейки имеют тип Base
+    struct ShapeSlot {
+        ShapeType type;
+        std::uint32_t index;
+        std::uint32_t generation;
+    };
+    std::vector<ShapeSlot> slots;
+    std::vector<std::uint32_t> freeSlots;
+    std::vector<std::uint32_t> squareSlots;
+    std::vector<std::uint32_t> circleSlots;
+    std::uint32_t generationFloor = 0; // поколение новых ячеек: больше поколений всех отброшенных
+
+    // Учёт изменений для takeDelta(): флаги Slot* по ячейкам, список изменённых ячеек
+    // и поколение + 1, известное зрителю (0 - у зрителя ячейка пуста)
+    enum : std::uint8_t { SlotReplaced = 1, SlotMoved = 2, SlotResized = 4 };
+    bool trackingDeltas = false;
+    bool deltaReset = true;
+    std::uint64_t sceneVersion = 0;
+    std::vector<std::uint8_t> slotChanges;
+    std::vector<std::uint32_t> changedSlots;
+    std::vector<std::uint32_t> shippedGenerations;
+
+    // Хранилище для режима StorageMode::Arena: менеджер единственный владелец, поэтому shared_ptr не нужен
+    ShapeArena arena;
+    std::vector<ShapeRef<Shape>> arenaShapes;
+
+    // Хранилище для режима StorageMode::Variant
+    std::vector<ShapeValue> variantShapes;
+
+    // Хранилище для режима StorageMode::Mapped: файл, загруженный loadScene(), и фигуры, добавленные после загрузки
+    std::unique_ptr<SceneFile> sceneFile;
+    std::vector<SceneRecord> extraRecords;
+    const SceneRecord* baseRecords = nullptr; // записи файла или статической сцены loadStaticScene()
+    std::size_t baseCount = 0;
+
+    DrawStats drawStats;
+
+    CommandBuffer instanceCmds;   // команды кадра перед группировкой drawInstanced()
+    InstanceBuffer instanceFrame;
+
+    LodOptions lod;
+    std::unordered_map<LodCell, std::uint32_t, LodCellHash> lodCells; // ячейка -> номер метки в lodClusters
+    std::vector<DrawCmd> lodClusters;
+
+    // Число фигур по типам для countOfType() и счётчиков полного кадра без прохода по сцене.
+    // В режиме Mapped записи файла считаются отдельно, один раз и только по запросу
+    std::size_t typeCounts[DrawStats::TypeCount] = {};
+    mutable std::size_t fileTypeCounts[DrawStats::TypeCount] = {};
+    mutable bool fileTypeCountsValid = false;
+
+    // Пространственный индекс плотного хранилища, создаётся enableSpatialIndex()
+    std::unique_ptr<SpatialGrid> grid;
+    ShapeSelection visible;
+
+    // Отслеживание изменений для drawDirty() в режиме Packed: команды прошлого кадра и изменённые индексы.
+    // Включается enableDirtyTracking(), без него изменения фигур ничего не отмечают
+    std::vector<DrawCmd> squareFrame;
+    std::vector<DrawCmd> circleFrame;
+    DirtySet squareDirty;
+    DirtySet circleDirty;
+    bool frameValid = false;
+    bool trackingDirty = false;
+
+    std::unique_ptr<RenderSink> sink; // приёмник по умолчанию для drawShapes()
+    std::vector<CommandBuffer> chunkBuffers; // буферы кусков параллельного рисования, переиспользуются между кадрами
+
+public:
+    // Начальная сцена конструктора, известна при компиляции
+    static constexpr std::array<SceneRecord, 2> DefaultScene = {
+        MakeSceneRecord(ShapeType::Square, Point(0, 0), 3),
+        MakeSceneRecord(ShapeType::Circle, Point(0, 0), 3),
+    };
+
+    // Здесь различные конструкторы
+    DrwManager(StorageMode m = StorageMode::List) : mode(m), sink(new TextRenderSink(std::cout)) {
+        // Такая инициализация только для примера
+        addShapes(DefaultScene.begin(), DefaultScene.end());
+    }
+
+    StorageMode GetMode() const { return mode; }
+
+    // Заменяет приёмник, в который выводит drawShapes()
+    void setSink(std::unique_ptr<RenderSink> s) { sink = std::move(s); }
+    // Текстовый вывод drawShapes() через писателя (файл, буфер) вместо std::cout
+    void setOutput(OutputWriter& w) { sink.reset(new TextRenderSink(w)); }
+    RenderSink& getSink() { return *sink; }
+
+    // Добавление фигуры. В режиме Packed возвращает устойчивую ссылку на неё, в остальных - пустую
+    ShapeHandle addCircle(Point c, int r) {
+        ++typeCounts[static_cast<std::size_t>(ShapeType::Circle)];
+        switch (mode) {
+        case StorageMode::Packed:
+            circles.push(c, r);
+            markDirty(ShapeType::Circle, circles.count() - 1);
+            if (grid)
+                grid->insert(ShapeType::Circle, std::uint32_t(circles.count() - 1), Circle::BoundsAt(c, r));
+            return allocSlot(ShapeType::Circle, circles.count() - 1);
+        case StorageMode::Arena:
+            arenaShapes.push_back(arena.create<Circle>(c, r));
+            break;
+        case StorageMode::Variant:
+            variantShapes.emplace_back(std::in_place_type<Circle>, c, r);
+            break;
+        case StorageMode::Mapped:
+            extraRecords.push_back(MakeSceneRecord(ShapeType::Circle, c, r));
+            break;
+        default:
+            shapeList.push_back(std::make_shared<Circle>(c, r));
+        }
+        return ShapeHandle();
+    }
+
+    ShapeHandle addSquare(Point c, int s) {
+        ++typeCounts[static_cast<std::size_t>(ShapeType::Square)];
+        switch (mode) {
+        case StorageMode::Packed:
+            squares.push(c, s);
+            markDirty(ShapeType::Square, squares.count() - 1);
+            if (grid)
+                grid->insert(ShapeType::Square, std::uint32_t(squares.count() - 1), Square::BoundsAt(c, s));
+            return allocSlot(ShapeType::Square, squares.count() - 1);
+        case StorageMode::Arena:
+            arenaShapes.push_back(arena.create<Square>(c, s));
+            break;
+        case StorageMode::Variant:
+            variantShapes.emplace_back(std::in_place_type<Square>, c, s);
+            break;
+        case StorageMode::Mapped:
+            extraRecords.push_back(MakeSceneRecord(ShapeType::Square, c, s));
+            break;
+        default:
+            shapeList.push_back(std::make_shared<Square>(c, s));
+        }
+        return ShapeHandle();
+    }
+
+    // Пакетное добавление фигур из диапазона значений ShapeValue или записей SceneRecord.
+    // Для диапазонов с повторным проходом память хранилища выделяется один раз под всю пачку.
+    // В режиме Packed ссылки на добавленные фигуры дописываются в handles, если он задан
+    template <class InputIt>
+    std::size_t addShapes(InputIt first, InputIt last, std::vector<ShapeHandle>* handles = nullptr) {
+        using Category = typename std::iterator_traits<InputIt>::iterator_category;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, Category>::value) {
+            std::size_t n[DrawStats::TypeCount] = {};
+            for (InputIt it = first; it != last; ++it)
+                ++n[static_cast<std::size_t>(typeOf(*it))];
+            reserveShapes(n[static_cast<std::size_t>(ShapeType::Circle)], n[static_cast<std::size_t>(ShapeType::Square)]);
+            if (handles && mode == StorageMode::Packed)
+                handles->reserve(handles->size() + n[static_cast<std::size_t>(ShapeType::Circle)] +
+                                 n[static_cast<std::size_t>(ShapeType::Square)]);
+        }
+        std::size_t added = 0;
+        for (; first != last; ++first) {
+            const ShapeType t = typeOf(*first);
+            if (t != ShapeType::Circle && t != ShapeType::Square)
+                continue;
+            const ShapeHandle h = addValue(*first);
+            if (handles && mode == StorageMode::Packed)
+                handles->push_back(h);
+            ++added;
+        }
+        return added;
+    }
+
+    template <class Range>
+    std::size_t addShapes(const Range& shapes, std::vector<ShapeHandle>* handles = nullptr) {
+        using std::begin;
+        using std::end;
+        return addShapes(begin(shapes), end(shapes), handles);
+    }
+
+    // Удаляет все фигуры, для которых pred(const Shape&) истинно, возвращает число удалённых.
+    // Packed: перестановкой последней фигуры типа на место удалённой (устойчивые ссылки остальных
+    // фигур остаются верными), List/Variant/Arena: с сохранением порядка. В режиме Mapped
+    // удаляются только фигуры, добавленные после загрузки, записи файла неизменяемы
+    template <class Pred>
+    std::size_t removeIf(Pred pred) {
+        const std::size_t before = shapeCount();
+        switch (mode) {
+        case StorageMode::Packed:
+            removeIfInColumns<Square>(pred);
+            removeIfInColumns<Circle>(pred);
+            return before - shapeCount();
+        case StorageMode::Arena:
+            arenaShapes.erase(std::remove_if(arenaShapes.begin(), arenaShapes.end(), [&](ShapeRef<Shape> shape) {
+                return removeCounted(*shape, pred);
+            }), arenaShapes.end());
+            break;
+        case StorageMode::Variant:
+            variantShapes.erase(std::remove_if(variantShapes.begin(), variantShapes.end(), [&](const ShapeValue& value) {
+                return std::visit([&](const auto& shape) { return removeCounted(shape, pred); }, value);
+            }), variantShapes.end());
+            break;
+        case StorageMode::Mapped:
+            extraRecords.erase(std::remove_if(extraRecords.begin(), extraRecords.end(), [&](const SceneRecord& r) {
+                bool remove = false;
+                auto check = [&](const Shape& shape) { remove = removeCounted(shape, pred); };
+                forRecordObject(r, check);
+                return remove;
+            }), extraRecords.end());
+            break;
+        default:
+            shapeList.remove_if([&](const std::shared_ptr<Shape>& shape) { return removeCounted(*shape, pred); });
+        }
+        frameValid = false;
+        return before - shapeCount();
+    }
+
+    // Возвращает лишнюю память после удалений: ёмкости хранилищ подгоняются под число фигур,
+    // арена (режим Arena) пересобирается только из живых фигур, пространственный индекс строится заново,
+    // свободные ячейки в конце таблицы ссылок отбрасываются
+    void compact() {
+        squares.shrink();
+        circles.shrink();
+        squareSlots.shrink_to_fit();
+        circleSlots.shrink_to_fit();
+        while (!slots.empty() && slots.back().type == ShapeType::Base) {
+            generationFloor = std::max(generationFloor, slots.back().generation + 1);
+            slots.pop_back();
+        }
+        freeSlots.erase(std::remove_if(freeSlots.begin(), freeSlots.end(),
+                                       [this](std::uint32_t slot) { return slot >= slots.size(); }), freeSlots.end());
+        slots.shrink_to_fit();
+        freeSlots.shrink_to_fit();
+        if (mode == StorageMode::Arena) {
+            std::vector<ShapeValue> live;
+            live.reserve(arenaShapes.size());
+            for (ShapeRef<Shape> shape : arenaShapes) {
+                if (shape->GetTypeTag() == ShapeType::Circle)
+                    live.emplace_back(static_cast<const Circle&>(*shape));
+                else
+                    live.emplace_back(static_cast<const Square&>(*shape));
+            }
+            arenaShapes.clear();
+            arena.release();
+            for (const ShapeValue& value : live)
+                std::visit([this](const auto& shape) {
+                    using T = std::decay_t<decltype(shape)>;
+                    arenaShapes.push_back(arena.create<T>(shape));
+                }, value);
+        }
+        arenaShapes.shrink_to_fit();
+        variantShapes.shrink_to_fit();
+        extraRecords.shrink_to_fit();
+        squareFrame.shrink_to_fit();
+        circleFrame.shrink_to_fit();
+        chunkBuffers.clear();
+        chunkBuffers.shrink_to_fit();
+        if (grid)
+            enableSpatialIndex(grid->getCellSize());
+    }
+
+    // Устойчивые ссылки (режим Packed)
+
+    bool contains(ShapeHandle h) const {
+        return h.slot < slots.size() && slots[h.slot].type != ShapeType::Base && slots[h.slot].generation == h.generation;
+    }
+
+    // Текущее место фигуры в столбцах; false для недействительной ссылки
+    bool resolve(ShapeHandle h, ShapeType& t, std::size_t& index) const {
+        if (!contains(h))
+            return false;
+        t = slots[h.slot].type;
+        index = slots[h.slot].index;
+        return true;
+    }
+
+    ShapeHandle handleAt(ShapeType t, std::size_t index) const {
+        const std::vector<std::uint32_t>* owners = t == ShapeType::Circle ? &circleSlots : t == ShapeType::Square ? &squareSlots : nullptr;
+        if (mode != StorageMode::Packed || !owners || index >= owners->size())
+            return ShapeHandle();
+        const std::uint32_t slot = (*owners)[index];
+        return ShapeHandle{ slot, slots[slot].generation };
+    }
+
+    bool removeShape(ShapeHandle h) {
+        ShapeType t;
+        std::size_t index;
+        return resolve(h, t, index) && removeShape(t, index);
+    }
+
+    bool setCenter(ShapeHandle h, Point c) {
+        ShapeType t;
+        std::size_t index;
+        return resolve(h, t, index) && setCenter(t, index, c);
+    }
+
+    bool setSize(ShapeHandle h, int size) {
+        ShapeType t;
+        std::size_t index;
+        return resolve(h, t, index) && setSize(t, index, size);
+    }
+
+    std::size_t shapeCount() const {
+        switch (mode) {
+        case StorageMode::Packed:
+            return squares.count() + circles.count();
+        case StorageMode::Arena:
+            return arenaShapes.size();
+        case StorageMode::Variant:
+            return variantShapes.size();
+        case StorageMode::Mapped:
+            return mappedCount() + extraRecords.size();
+        default:
+            return shapeList.size();
+        }
+    }
+
+    // Удаляет фигуру плотного хранилища (режим Packed) по типу и индексу в столбцах.
+    // На место удалённой переставляется последняя фигура того же типа, индекс обновляется инкрементально
+    bool removeShape(ShapeType t, std::size_t index) {
+        if (mode != StorageMode::Packed)
+            return false;
+        ShapeColumns* cols = columnsFor(t);
+        if (!cols || index >= cols->count())
+            return false;
+        const std::size_t last = cols->count() - 1;
+        if (grid) {
+            grid->erase(t, std::uint32_t(index), boundsOf(t, *cols, index));
+            if (index != last)
+                grid->renumber(t, std::uint32_t(last), std::uint32_t(index), boundsOf(t, *cols, last));
+        }
+        cols->swapRemove(index);
+        if (trackingDirty)
+            dirtyFor(t).swapRemove(index, cols->count());
+        --typeCounts[static_cast<std::size_t>(t)];
+        std::vector<std::uint32_t>& owners = t == ShapeType::Circle ? circleSlots : squareSlots;
+        freeSlot(owners[index]);
+        owners[index] = owners[last];
+        slots[owners[index]].index = static_cast<std::uint32_t>(index);
+        owners.pop_back();
+        return true;
+    }
+
+    // Сеттеры фигур плотного хранилища (режим Packed): отмечают фигуру изменённой и обновляют индекс
+    bool setCenter(ShapeType t, std::size_t index, Point c) {
+        ShapeColumns* cols = mode == StorageMode::Packed ? columnsFor(t) : nullptr;
+        if (!cols || index >= cols->count())
+            return false;
+        if (grid)
+            grid->erase(t, std::uint32_t(index), boundsOf(t, *cols, index));
+        cols->x[index] = c.x;
+        cols->y[index] = c.y;
+        if (grid)
+            grid->insert(t, std::uint32_t(index), boundsOf(t, *cols, index));
+        markDirty(t, index);
+        noteColumnChange(t, index, SlotMoved);
+        return true;
+    }
+
+    bool setSize(ShapeType t, std::size_t index, int size) {
+        ShapeColumns* cols = mode == StorageMode::Packed ? columnsFor(t) : nullptr;
+        if (!cols || index >= cols->count())
+            return false;
+        if (grid)
+            grid->erase(t, std::uint32_t(index), boundsOf(t, *cols, index));
+        cols->size[index] = size;
+        if (grid)
+            grid->insert(t, std::uint32_t(index), boundsOf(t, *cols, index));
+        markDirty(t, index);
+        noteColumnChange(t, index, SlotResized);
+        return true;
+    }
+
+    // Учёт изменённых фигур для drawDirty() (режим Packed). Выключен по умолчанию, чтобы добавления и
+    // изменения фигур не платили за отметки; без него drawDirty() каждый раз строит кадр целиком
+    void enableDirtyTracking() {
+        trackingDirty = true;
+        frameValid = false;
+    }
+
+    void disableDirtyTracking() {
+        trackingDirty = false;
+        frameValid = false;
+        squareDirty.reset();
+        circleDirty.reset();
+        squareFrame = std::vector<DrawCmd>();
+        circleFrame = std::vector<DrawCmd>();
+    }
+
+    bool isTrackingDirty() const { return trackingDirty; }
+
+    // Число фигур, изменённых с прошлого drawDirty() (повторы не исключаются); 0 без учёта изменений
+    std::size_t dirtyCount() const { return squareDirty.list.size() + circleDirty.list.size(); }
+
+    // Заставляет следующий drawDirty() перестроить кадр целиком
+    void markAllDirty() { frameValid = false; }
+
+    // Дельты сцены для удалённых зрителей (SceneReplica). С включённым учётом изменения фигур режима
+    // Packed отмечаются по ячейкам устойчивых ссылок, и takeDelta() собирает только их: размер дельты
+    // и время её сборки пропорциональны числу изменённых фигур. Первая дельта после включения и после
+    // clear() / loadScene() - полная сцена со сбросом; в остальных режимах полная сцена - каждая дельта
+    void enableDeltaTracking() {
+        trackingDeltas = true;
+        deltaReset = true;
+    }
+
+    void disableDeltaTracking() {
+        trackingDeltas = false;
+        slotChanges.clear();
+        changedSlots.clear();
+        shippedGenerations.clear();
+    }
+
+    bool isTrackingDeltas() const { return trackingDeltas; }
+    std::uint64_t getSceneVersion() const { return sceneVersion; }
+
+    // Изменения с прошлой дельты; переводит сцену на следующую версию
+    SceneDelta takeDelta() {
+        SceneDelta d;
+        d.fromVersion = sceneVersion;
+        d.toVersion = ++sceneVersion;
+        if (mode != StorageMode::Packed || !trackingDeltas || deltaReset) {
+            fullDelta(d);
+            deltaReset = false;
+            return d;
+        }
+        d.changes.reserve(changedSlots.size());
+        for (std::uint32_t slot : changedSlots) {
+            const std::uint8_t change = slotChanges[slot];
+            slotChanges[slot] = 0;
+            const bool alive = slot < slots.size() && slots[slot].type != ShapeType::Base;
+            if (slot >= shippedGenerations.size())
+                shippedGenerations.resize(std::size_t(slot) + 1, 0);
+            std::uint32_t& shipped = shippedGenerations[slot];
+            if (alive && shipped == slots[slot].generation + 1) {
+                const ShapeChange now = addedChange(slot);
+                if (change & SlotMoved)
+                    d.changes.push_back(ShapeChange{ DeltaOp::Move, now.type, now.handle, now.center, 0 });
+                if (change & SlotResized)
+                    d.changes.push_back(ShapeChange{ DeltaOp::Resize, now.type, now.handle, Point(), now.size });
+            }
+            else if (alive) {
+                d.changes.push_back(addedChange(slot)); // новая фигура в ячейке заменяет прежнюю у зрителя
+                shipped = slots[slot].generation + 1;
+            }
+            else if (shipped) {
+                d.changes.push_back(ShapeChange{ DeltaOp::Remove, ShapeType::Base, ShapeHandle{ slot, shipped - 1 }, Point(), 0 });
+                shipped = 0;
+            }
+        }
+        changedSlots.clear();
+        return d;
+    }
+
+    // Счётчики рисования: число и время записи команд по типам, выводы приёмника.
+    // Время по типам точное там, где типы записываются отдельными проходами (Packed); в смешанном
+    // хранилище время прохода делится между типами пропорционально числу их команд
+    const DrawStats& getDrawStats() const { return drawStats; }
+    void resetDrawStats() { drawStats = DrawStats(); }
+
+    // Включает пространственный индекс над плотным хранилищем (режим Packed) и строит его по текущей сцене
+    void enableSpatialIndex(int cellSize = 64) {
+        grid.reset(new SpatialGrid(cellSize));
+        for (std::size_t i = 0; i < squares.count(); ++i)
+            grid->insert(ShapeType::Square, std::uint32_t(i), boundsOf(ShapeType::Square, squares, i));
+        for (std::size_t i = 0; i < circles.count(); ++i)
+            grid->insert(ShapeType::Circle, std::uint32_t(i), boundsOf(ShapeType::Circle, circles, i));
+    }
+
+    void disableSpatialIndex() { grid.reset(); }
+    bool hasSpatialIndex() const { return grid != nullptr; }
+
+    // Удаляет все фигуры сцены. В режиме Arena это один сброс арены, память остаётся для следующей сцены
+    void clear() {
+        shapeList.clear();
+        squares.clear();
+        circles.clear();
+        arenaShapes.clear();
+        arena.reset();
+        variantShapes.clear();
+        sceneFile.reset();
+        baseRecords = nullptr;
+        baseCount = 0;
+        extraRecords.clear();
+        std::fill(std::begin(typeCounts), std::end(typeCounts), std::size_t(0));
+        fileTypeCountsValid = false;
+        for (const ShapeSlot& slot : slots)
+            generationFloor = std::max(generationFloor, slot.generation + 1);
+        slots.clear();
+        freeSlots.clear();
+        squareSlots.clear();
+        circleSlots.clear();
+        if (grid)
+            grid->clear();
+        squareDirty.reset();
+        circleDirty.reset();
+        frameValid = false;
+        deltaReset = true;
+    }
+
+    const ShapeArena& getArena() const { return arena; }
+
+    // Загружает сцену из файла формата SceneFile вместо текущей. В режиме Mapped файл отображается в память
+    // и рисуется без разбора, в остальных режимах записи переносятся в хранилище режима.
+    // При ошибке возвращает false, текущая сцена не меняется
+    bool loadScene(const std::string& path) {
+        std::unique_ptr<SceneFile> file(new SceneFile());
+        if (!file->open(path))
+            return false;
+        clear();
+        if (mode == StorageMode::Mapped) {
+            sceneFile = std::move(file);
+            baseRecords = sceneFile->records();
+            baseCount = sceneFile->count();
+            return true;
+        }
+        const SceneRecord* records = file->records();
+        for (std::size_t i = 0; i < file->count(); ++i) {
+            const Point c(records[i].x, records[i].y);
+            if (records[i].type == static_cast<std::uint8_t>(ShapeType::Circle))
+                addCircle(c, records[i].size);
+            else if (records[i].type == static_cast<std::uint8_t>(ShapeType::Square))
+                addSquare(c, records[i].size);
+        }
+        return true;
+    }
+
+    // Сцена из неизменяемого массива записей, обычно constexpr std::array в данных только для чтения.
+    // В режиме Mapped записи рисуются прямо из массива (как из отображённого файла): ни разбора, ни выделений
+    // памяти, массив должен жить, пока он загружен. В остальных режимах записи переносятся в хранилище режима
+    void loadStaticScene(const SceneRecord* records, std::size_t count) {
+        clear();
+        if (mode == StorageMode::Mapped) {
+            baseRecords = records;
+            baseCount = count;
+            return;
+        }
+        addShapes(records, records + count);
+    }
+
+    template <std::size_t N>
+    void loadStaticScene(const std::array<SceneRecord, N>& records) {
+        loadStaticScene(records.data(), N);
+    }
+
+    // Сохраняет сцену в порядке рисования drawShapes()
+    bool saveScene(const std::string& path) const {
+        std::vector<SceneRecord> records;
+        records.reserve(shapeCount());
+        if (mode == StorageMode::Packed) {
+            for (std::size_t i = 0; i < squares.count(); ++i)
+                records.push_back(MakeSceneRecord(ShapeType::Square, Point(squares.x[i], squares.y[i]), squares.size[i]));
+            for (std::size_t i = 0; i < circles.count(); ++i)
+                records.push_back(MakeSceneRecord(ShapeType::Circle, Point(circles.x[i], circles.y[i]), circles.size[i]));
+        }
+        else {
+            forEachObject([&records](const Shape& shape) {
+                records.push_back(MakeSceneRecord(shape.GetTypeTag(), shape.GetCenter(), sizeOf(shape)));
+            });
+        }
+        return SceneFile::write(path, records.data(), records.size());
+    }
+
+    // true, если сцена режима Mapped отображена в память, а не прочитана в буфер
+    bool isSceneMapped() const { return sceneFile && sceneFile->isMapped(); }
+
+    // Потоковое рисование сцен больше памяти: фигуры берутся кусками по chunkSize, каждый кусок
+    // рисуется, выводится и отбрасывается. Хранимая сцена менеджера не меняется, пиковая память задаётся
+    // размером куска. Бинарный приёмник выводит каждый кусок отдельным кадром. Возвращает число прочитанных фигур
+
+    // Из диапазона записей SceneRecord (например, итераторов генератора или istream_iterator-подобных)
+    template <class InputIt>
+    std::size_t drawStream(InputIt first, InputIt last, std::size_t chunkSize = 65536) {
+        return drawStream(first, last, *sink, chunkSize);
+    }
+
+    template <class InputIt>
+    std::size_t drawStream(InputIt first, InputIt last, RenderSink& target, std::size_t chunkSize = 65536) {
+        if (chunkSize == 0)
+            chunkSize = 1;
+        noteFrame();
+        std::size_t n = 0;
+        std::size_t chunkFirst = target.Size();
+        std::uint64_t chunkStart = statsClock();
+        for (; first != last; ++first, ++n) {
+            const SceneRecord& r = *first;
+            recordRecords(&r, 1, target);
+            if (target.Size() >= chunkSize) {
+                noteCommands(target, chunkFirst, statsClock() - chunkStart);
+                measureFlush(target);
+                chunkFirst = 0;
+                chunkStart = statsClock();
+            }
+        }
+        noteCommands(target, chunkFirst, statsClock() - chunkStart);
+        measureFlush(target);
+        return n;
+    }
+
+    // Из потока в формате файла сцены. При неверном заголовке у потока ставится failbit
+    std::size_t drawStream(std::istream& in, std::size_t chunkSize = 65536) {
+        return drawStream(in, *sink, chunkSize);
+    }
+
+    std::size_t drawStream(std::istream& in, RenderSink& target, std::size_t chunkSize = 65536) {
+        SceneHeader header;
+        if (in.read(reinterpret_cast<char*>(&header), sizeof(header)))
+            SceneFile::convertByteOrder(header);
+        if (!in || !SceneFile::validHeader(header)) {
+            in.setstate(std::ios::failbit);
+            return 0;
+        }
+        if (chunkSize == 0)
+            chunkSize = 1;
+        noteFrame();
+        std::uint64_t left = header.count;
+        std::size_t n = 0;
+        // Буфер локальный: после вызова менеджер не держит память размером с кусок
+        std::vector<SceneRecord> chunk(static_cast<std::size_t>(std::min<std::uint64_t>(left, chunkSize)));
+        while (left != 0) {
+            const std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(left, chunkSize));
+            in.read(reinterpret_cast<char*>(chunk.data()), static_cast<std::streamsize>(want * sizeof(SceneRecord)));
+            const std::size_t got = static_cast<std::size_t>(in.gcount()) / sizeof(SceneRecord);
+            SceneFile::convertByteOrder(chunk.data(), got);
+            measureRecord(target, [&] { recordRecords(chunk.data(), got, target); });
+            measureFlush(target);
+            n += got;
+            left -= got;
+            if (got < want)
+                break;
+        }
+        return n;
+    }
+
+    // Обходит только фигуры заданного типа, фильтр сравнивает теги, а не строки.
+    // В режиме Packed функции передаётся временный объект, собранный из столбцов
+    template <class F>
+    void forEachOfType(ShapeType t, F f) const {
+        switch (mode) {
+        case StorageMode::Packed:
+            if (t == ShapeType::Circle)
+                forEachInColumns<Circle>(circles, f);
+            else if (t == ShapeType::Square)
+                forEachInColumns<Square>(squares, f);
+            break;
+        case StorageMode::Arena:
+            for (ShapeRef<Shape> shape : arenaShapes)
+                if (shape->GetTypeTag() == t)
+                    f(static_cast<const Shape&>(*shape));
+            break;
+        case StorageMode::Variant:
+            for (const ShapeValue& value : variantShapes)
+                std::visit([&](const auto& shape) {
+                    if (shape.GetTypeTag() == t)
+                        f(static_cast<const Shape&>(shape));
+                }, value);
+            break;
+        case StorageMode::Mapped:
+            forEachRecord([&](const SceneRecord& r) {
+                if (r.type == static_cast<std::uint8_t>(t))
+                    forRecordObject(r, f);
+            });
+            break;
+        default:
+            for (const auto& shape : shapeList)
+                if (shape->GetTypeTag() == t)
+                    f(static_cast<const Shape&>(*shape));
+        }
+    }
+
+    std::size_t countOfType(ShapeType t) const {
+        const std::size_t i = static_cast<std::size_t>(t);
+        if (i >= DrawStats::TypeCount)
+            return 0;
+        std::size_t n = typeCounts[i];
+        if (mode == StorageMode::Mapped && baseRecords) {
+            if (!fileTypeCountsValid) {
+                std::fill(std::begin(fileTypeCounts), std::end(fileTypeCounts), std::size_t(0));
+                for (std::size_t k = 0; k < baseCount; ++k)
+                    if (baseRecords[k].type < DrawStats::TypeCount)
+                        ++fileTypeCounts[baseRecords[k].type];
+                fileTypeCountsValid = true;
+            }
+            n += fileTypeCounts[i];
+        }
+        return n;
+    }
+
+    // Метод рисует все фигуры из списка shapeList (или из плотных массивов в режиме Packed).
+    // Команды всего кадра копятся в приёмнике и выводятся одной записью
+    void drawShapes() {
+        drawShapes(*sink);
+    }
+
+    void drawShapes(RenderSink& target) {
+        noteFrame();
+        if (mode == StorageMode::Packed) {
+            // Типы записываются и замеряются отдельно, время по типам точное
+            target.Reserve(target.Size() + shapeCount());
+            const std::uint64_t start = statsClock();
+            recordColumns<Square>(squares, target);
+            const std::uint64_t middle = statsClock();
+            recordColumns<Circle>(circles, target);
+            noteShapes(0, squares.count(), middle - start);
+            noteShapes(circles.count(), 0, statsClock() - middle);
+        }
+        else {
+            measureFrame([&] { recordShapes(target); });
+        }
+        measureFlush(target);
+    }
+
+    // Рисует только фигуры, пересекающие окно просмотра. Порядок тот же, что у drawShapes().
+    // В режиме Packed с включённым индексом обходятся только ячейки окна, иначе - линейный отбор
+    void drawShapes(const Rect& viewport) {
+        drawShapes(viewport, *sink);
+    }
+
+    void drawShapes(const Rect& viewport, RenderSink& target) {
+        noteFrame();
+        measureRecord(target, [&] { recordShapes(viewport, target); });
+        measureFlush(target);
+    }
+
+    void recordShapes(const Rect& viewport, CommandBuffer& buf) {
+        if (mode == StorageMode::Mapped) {
+            forEachRecord([&](const SceneRecord& r) {
+                const Point c(r.x, r.y);
+                if (r.type == static_cast<std::uint8_t>(ShapeType::Circle)) {
+                    if (Circle::BoundsAt(c, r.size).Intersects(viewport))
+                        Circle::DrawAt(buf, c, r.size);
+                }
+                else if (r.type == static_cast<std::uint8_t>(ShapeType::Square)) {
+                    if (Square::BoundsAt(c, r.size).Intersects(viewport))
+                        Square::DrawAt(buf, c, r.size);
+                }
+            });
+            return;
+        }
+        if (mode != StorageMode::Packed) {
+            forEachObject([&](const Shape& shape) {
+                if (shape.GetBounds().Intersects(viewport))
+                    shape.Draw(buf);
+            });
+            return;
+        }
+        visible.clear();
+        if (grid) {
+            grid->query(viewport, [this](ShapeType t, std::uint32_t index) { visible.of(t).push_back(index); });
+            std::sort(visible.squares.begin(), visible.squares.end());
+            std::sort(visible.circles.begin(), visible.circles.end());
+        }
+        else {
+            selectInViewport(viewport, visible);
+        }
+        for (std::uint32_t i : visible.squares)
+            Square::DrawAt(buf, Point(squares.x[i], squares.y[i]), squares.size[i]);
+        for (std::uint32_t i : visible.circles)
+            Circle::DrawAt(buf, Point(circles.x[i], circles.y[i]), circles.size[i]);
+    }
+
+    // Конвейерное рисование: кадр записывается в свободный буфер конвейера и отдаётся фоновому
+    // потоку вывода, вызов возвращается, не дожидаясь вывода. Вывод совпадает с drawShapes() в приёмник конвейера.
+    // Выводы конвейера не попадают в flushes/bytes счётчиков рисования: их считает сам приёмник
+    FrameFence drawShapesAsync(FramePipeline& pipeline) {
+        CommandBuffer& buf = pipeline.acquire();
+        noteFrame();
+        measureFrame([&] { recordShapes(buf); });
+        return pipeline.submit();
+    }
+
+    // Инстансное рисование: одинаковые фигуры (тип и размер) уходят одной группой с массивом центров.
+    // bucketBySize == false - группы из подряд идущих одинаковых фигур, порядок drawShapes() сохраняется;
+    // true - одна группа на (тип, размер) за кадр, меньше групп, но порядок между группами другой
+    void drawInstanced(bool bucketBySize = false) {
+        drawInstanced(*sink, bucketBySize);
+    }
+
+    void drawInstanced(RenderSink& target, bool bucketBySize = false) {
+        noteFrame();
+        measureFrame([&] { recordInstanced(instanceFrame, bucketBySize); });
+        measureFlushWith(target, [&] { target.FlushInstanced(instanceFrame); });
+    }
+
+    void recordInstanced(InstanceBuffer& out, bool bucketBySize = false) {
+        instanceCmds.Clear();
+        recordShapes(instanceCmds);
+        const DrawCmd* cmds = instanceCmds.Commands().data();
+        if (bucketBySize)
+            out.BuildBuckets(cmds, instanceCmds.Size());
+        else
+            out.BuildRuns(cmds, instanceCmds.Size());
+    }
+
+    // Рисование с уровнем детализации: scale - пикселей экрана на единицу сцены (0.01 - масштаб 1%).
+    // Фигуры с экранным размером (диаметр круга, сторона квадрата) не меньше порога рисуются как обычно
+    // и в порядке drawShapes(), мелкие - точками DrawOp::Dot на своём месте или, с mergeSmall,
+    // одной меткой DrawOp::Cluster на ячейку после всех крупных фигур (в порядке первого попадания в ячейку).
+    // Если мелких фигур нет, вывод совпадает с drawShapes()
+    void setLodOptions(const LodOptions& options) { lod = options; }
+    const LodOptions& getLodOptions() const { return lod; }
+
+    void drawShapes(double scale) {
+        drawShapes(scale, *sink);
+    }
+
+    void drawShapes(double scale, RenderSink& target) {
+        noteFrame();
+        measureRecord(target, [&] { recordShapes(scale, target); });
+        measureFlush(target);
+    }
+
+    void recordShapes(double scale, CommandBuffer& buf) {
+        const double minSize = scale > 0 ? lod.minScreenSize / scale : 0;
+        const double cellSize = scale > 0 ? std::max(lod.cellScreenSize, 1.0) / scale : 1.0;
+        const double cellsPerUnit = 1.0 / cellSize;
+        lodCells.clear();
+        lodClusters.clear();
+        // Соседние фигуры обычно попадают в одну ячейку: последняя ячейка проверяется без хеш-таблицы
+        LodCell lastKey = { 0, 0 };
+        std::uint32_t lastCluster = UINT32_MAX;
+        auto emit = [&](ShapeType t, Point c, int size) {
+            const double extent = t == ShapeType::Circle ? 2.0 * size : size;
+            if (extent >= minSize) {
+                if (t == ShapeType::Circle)
+                    Circle::DrawAt(buf, c, size);
+                else
+                    Square::DrawAt(buf, c, size);
+            }
+            else if (!lod.mergeSmall) {
+                buf.Push(DrawOp::Dot, c, size);
+            }
+            else {
+                // Ограничение до 2^62 только защищает приведение к int64 при запредельном масштабе
+                const double limit = 4611686018427387904.0;
+                const std::int64_t cx = static_cast<std::int64_t>(std::max(-limit, std::min(limit, std::floor(c.x * cellsPerUnit))));
+                const std::int64_t cy = static_cast<std::int64_t>(std::max(-limit, std::min(limit, std::floor(c.y * cellsPerUnit))));
+                const LodCell key = { cx, cy };
+                if (lastCluster == UINT32_MAX || key != lastKey) {
+                    auto it = lodCells.try_emplace(key, static_cast<std::uint32_t>(lodClusters.size()));
+                    if (it.second) {
+                        const Point center(static_cast<int>(std::lround((static_cast<double>(cx) + 0.5) * cellSize)),
+                                           static_cast<int>(std::lround((static_cast<double>(cy) + 0.5) * cellSize)));
+                        lodClusters.push_back(DrawCmd{ DrawOp::Cluster, center, 0 });
+                    }
+                    lastKey = key;
+                    lastCluster = it.first->second;
+                }
+                ++lodClusters[lastCluster].size;
+            }
+        };
+        if (mode == StorageMode::Packed) {
+            for (std::size_t i = 0; i < squares.count(); ++i)
+                emit(ShapeType::Square, Point(squares.x[i], squares.y[i]), squares.size[i]);
+            for (std::size_t i = 0; i < circles.count(); ++i)
+                emit(ShapeType::Circle, Point(circles.x[i], circles.y[i]), circles.size[i]);
+        }
+        else if (mode == StorageMode::Mapped) {
+            forEachRecord([&](const SceneRecord& r) {
+                if (r.type == static_cast<std::uint8_t>(ShapeType::Circle) || r.type == static_cast<std::uint8_t>(ShapeType::Square))
+                    emit(static_cast<ShapeType>(r.type), Point(r.x, r.y), r.size);
+            });
+        }
+        else {
+            forEachObject([&](const Shape& shape) { emit(shape.GetTypeTag(), shape.GetCenter(), sizeOf(shape)); });
+        }
+        buf.Append(lodClusters.data(), lodClusters.size());
+    }
+
+    // Инкрементальное рисование: команды неизменённых фигур берутся из кадра прошлого вызова,
+    // заново записываются только изменённые, добавленные и переставленные при удалении.
+    // Вывод совпадает с drawShapes(). Изменения учитываются только в режиме Packed и только через
+    // сеттеры менеджера setCenter()/setSize(): сеттеры самих объектов (Shape::SetCenter, Circle::SetRadius,
+    // Square::SetSide) о менеджере не знают и ничего не отмечают. Без enableDirtyTracking() и в режимах,
+    // кроме Packed (в том числе List по умолчанию), кадр всегда строится заново, как в drawShapes()
+    void drawDirty() {
+        drawDirty(*sink);
+    }
+
+    void drawDirty(RenderSink& target) {
+        noteFrame();
+        measureFrame([&] { recordDirty(target); });
+        measureFlush(target);
+    }
+
+    void recordDirty(CommandBuffer& buf) {
+        if (mode != StorageMode::Packed) {
+            recordShapes(buf);
+            return;
+        }
+        refreshFrame<Square>(squares, squareDirty, squareFrame);
+        refreshFrame<Circle>(circles, circleDirty, circleFrame);
+        frameValid = trackingDirty;
+        buf.Append(squareFrame.data(), squareFrame.size());
+        buf.Append(circleFrame.data(), circleFrame.size());
+    }
+
+    // Пакетные геометрические запросы к плотному хранилищу (режим Packed), результат дописывается в out
+
+    // Фигуры, чьи прямоугольники пересекают окно (линейный проход векторными ядрами, без индекса)
+    void selectInViewport(const Rect& viewport, ShapeSelection& out) const {
+        IntersectBatch(ShapeType::Square, squares.x.data(), squares.y.data(), squares.size.data(), squares.count(),
+                       viewport, out.squares);
+        IntersectBatch(ShapeType::Circle, circles.x.data(), circles.y.data(), circles.size.data(), circles.count(),
+                       viewport, out.circles);
+    }
+
+    // Фигуры, содержащие точку (выбор мышью)
+    void hitTest(Point p, ShapeSelection& out) const {
+        HitTestBatch(ShapeType::Square, squares.x.data(), squares.y.data(), squares.size.data(), squares.count(),
+                     p, out.squares);
+        HitTestBatch(ShapeType::Circle, circles.x.data(), circles.y.data(), circles.size.data(), circles.count(),
+                     p, out.circles);
+    }
+
+    // Прямоугольники всех фигур одного типа
+    void computeBounds(ShapeType t, BoundsColumns& out) const {
+        const ShapeColumns& cols = t == ShapeType::Circle ? circles : squares;
+        out.resize(cols.count());
+        ComputeBoundsBatch(t, cols.x.data(), cols.y.data(), cols.size.data(), cols.count(),
+                           out.minX.data(), out.minY.data(), out.maxX.data(), out.maxY.data());
+    }
+
+    // Прямоугольник всей сцены; для пустой сцены false
+    bool sceneBounds(Rect& out) const {
+        bool any = false;
+        BoundsColumns b;
+        for (ShapeType t : { ShapeType::Square, ShapeType::Circle }) {
+            computeBounds(t, b);
+            if (b.minX.empty())
+                continue;
+            const Rect r{ *std::min_element(b.minX.begin(), b.minX.end()), *std::min_element(b.minY.begin(), b.minY.end()),
+                          *std::max_element(b.maxX.begin(), b.maxX.end()), *std::max_element(b.maxY.begin(), b.maxY.end()) };
+            out = any ? Rect{ std::min(out.minX, r.minX), std::min(out.minY, r.minY),
+                              std::max(out.maxX, r.maxX), std::max(out.maxY, r.maxY) } : r;
+            any = true;
+        }
+        return any;
+    }
+
+    // Записывает команды всех фигур в буфер без вывода
+    void recordShapes(CommandBuffer& buf) const {
+        if (mode == StorageMode::Packed) {
+            buf.Reserve(buf.Size() + shapeCount());
+            recordColumns<Square>(squares, buf);
+            recordColumns<Circle>(circles, buf);
+            return;
+        }
+        if (mode == StorageMode::Arena) {
+            for (ShapeRef<Shape> shape : arenaShapes) {
+                shape->Draw(buf);
+            }
+            return;
+        }
+        if (mode == StorageMode::Variant) {
+            for (const ShapeValue& shape : variantShapes) {
+                DrawValue(shape, buf);
+            }
+            return;
+        }
+        if (mode == StorageMode::Mapped) {
+            buf.Reserve(buf.Size() + shapeCount());
+            recordRecords(baseRecords, mappedCount(), buf);
+            recordRecords(extraRecords.data(), extraRecords.size(), buf);
+            return;
+        }
+        for (const auto& shape : shapeList) {
+            shape->Draw(buf);
+        }
+    }
+
+    // Параллельное рисование: фигуры делятся на куски по chunkSize, куски выполняются в пуле,
+    // каждый кусок пишет в свой буфер. Буферы сливаются в порядке вставки, поэтому
+    // вывод побайтно совпадает с последовательным drawShapes()
+    void drawShapesParallel(WorkStealingPool& pool, std::size_t chunkSize = 4096) {
+        drawShapesParallel(pool, *sink, chunkSize);
+    }
+
+    void drawShapesParallel(WorkStealingPool& pool, RenderSink& target, std::size_t chunkSize = 4096) {
+        noteFrame();
+        measureFrame([&] { recordShapesParallel(pool, target, chunkSize); });
+        measureFlush(target);
+    }
+
+    void recordShapesParallel(WorkStealingPool& pool, CommandBuffer& buf, std::size_t chunkSize = 4096) {
+        if (chunkSize == 0)
+            chunkSize = 1;
+        std::size_t chunks;
+        if (mode == StorageMode::Packed) {
+            const std::size_t squareChunks = (squares.count() + chunkSize - 1) / chunkSize;
+            const std::size_t circleChunks = (circles.count() + chunkSize - 1) / chunkSize;
+            chunks = squareChunks + circleChunks;
+            prepareChunkBuffers(chunks);
+            pool.run(chunks, [&](std::size_t c) {
+                CommandBuffer& out = chunkBuffers[c];
+                if (c < squareChunks)
+                    recordColumns<Square>(squares, out, c * chunkSize, chunkSize);
+                else
+                    recordColumns<Circle>(circles, out, (c - squareChunks) * chunkSize, chunkSize);
+            });
+        }
+        else if (mode == StorageMode::Arena) {
+            chunks = runIndexedChunks(pool, arenaShapes.size(), chunkSize, [this](std::size_t k, CommandBuffer& out) {
+                arenaShapes[k]->Draw(out);
+            });
+        }
+        else if (mode == StorageMode::Variant) {
+            chunks = runIndexedChunks(pool, variantShapes.size(), chunkSize, [this](std::size_t k, CommandBuffer& out) {
+                DrawValue(variantShapes[k], out);
+            });
+        }
+        else if (mode == StorageMode::Mapped) {
+            const std::size_t mappedN = mappedCount();
+            chunks = runIndexedChunks(pool, shapeCount(), chunkSize, [this, mappedN](std::size_t k, CommandBuffer& out) {
+                recordRecords(k < mappedN ? baseRecords + k : extraRecords.data() + (k - mappedN), 1, out);
+            });
+        }
+        else {
+            // Список не даёт произвольного доступа, поэтому заранее запоминаем начало каждого куска
+            std::vector<std::list<std::shared_ptr<Shape>>::const_iterator> starts;
+            std::size_t i = 0;
+            for (auto it = shapeList.cbegin(); it != shapeList.cend(); ++it, ++i) {
+                if (i % chunkSize == 0)
+                    starts.push_back(it);
+            }
+            chunks = starts.size();
+            prepareChunkBuffers(chunks);
+            pool.run(chunks, [&](std::size_t c) {
+                CommandBuffer& out = chunkBuffers[c];
+                auto it = starts[c];
+                for (std::size_t k = 0; k < chunkSize && it != shapeList.cend(); ++k, ++it)
+                    (*it)->Draw(out);
+            });
+        }
+        for (std::size_t c = 0; c < chunks; ++c)
+            buf.Append(chunkBuffers[c]);
+    }
+
+private:
+    ShapeHandle allocSlot(ShapeType t, std::size_t index) {
+        std::uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else {
+            slot = static_cast<std::uint32_t>(slots.size());
+            slots.push_back(ShapeSlot{ ShapeType::Base, 0, generationFloor });
+        }
+        slots[slot].type = t;
+        slots[slot].index = static_cast<std::uint32_t>(index);
+        (t == ShapeType::Circle ? circleSlots : squareSlots).push_back(slot);
+        noteSlot(slot, SlotReplaced);
+        return ShapeHandle{ slot, slots[slot].generation };
+    }
+
+    void freeSlot(std::uint32_t slot) {
+        slots[slot].type = ShapeType::Base;
+        ++slots[slot].generation;
+        freeSlots.push_back(slot);
+        noteSlot(slot, SlotReplaced);
+    }
+
+    void noteSlot(std::uint32_t slot, std::uint8_t change) {
+        if (!trackingDeltas)
+            return;
+        if (slot >= slotChanges.size())
+            slotChanges.resize(std::size_t(slot) + 1, 0);
+        if (slotChanges[slot] == 0)
+            changedSlots.push_back(slot);
+        slotChanges[slot] |= change;
+    }
+
+    void noteColumnChange(ShapeType t, std::size_t index, std::uint8_t change) {
+        if (trackingDeltas)
+            noteSlot((t == ShapeType::Circle ? circleSlots : squareSlots)[index], change);
+    }
+
+    ShapeChange addedChange(std::uint32_t slot) const {
+        const ShapeSlot& s = slots[slot];
+        const ShapeColumns& cols = s.type == ShapeType::Circle ? circles : squares;
+        return ShapeChange{ DeltaOp::Add, s.type, ShapeHandle{ slot, s.generation },
+                            Point(cols.x[s.index], cols.y[s.index]), cols.size[s.index] };
+    }
+
+    // Полная сцена как сброс и добавление всех фигур; вне режима Packed ячейки - номера фигур по порядку
+    void fullDelta(SceneDelta& d) {
+        d.reset = true;
+        for (std::uint8_t& change : slotChanges)
+            change = 0;
+        changedSlots.clear();
+        shippedGenerations.assign(slots.size(), 0);
+        if (mode == StorageMode::Packed) {
+            d.changes.reserve(shapeCount());
+            for (std::uint32_t slot = 0; slot < slots.size(); ++slot) {
+                if (slots[slot].type == ShapeType::Base)
+                    continue;
+                d.changes.push_back(addedChange(slot));
+                shippedGenerations[slot] = slots[slot].generation + 1;
+            }
+            return;
+        }
+        forEachObject([this, &d](const Shape& shape) {
+            const std::uint32_t slot = static_cast<std::uint32_t>(d.changes.size());
+            d.changes.push_back(ShapeChange{ DeltaOp::Add, shape.GetTypeTag(), ShapeHandle{ slot, 0 }, shape.GetCenter(),
+                                             sizeOf(shape) });
+        });
+    }
+
+    static ShapeType typeOf(const ShapeValue& value) {
+        return std::visit([](const auto& shape) { return shape.GetTypeTag(); }, value);
+    }
+    static ShapeType typeOf(const SceneRecord& r) {
+        return r.type < DrawStats::TypeCount ? static_cast<ShapeType>(r.type) : ShapeType::Base;
+    }
+
+    ShapeHandle addValue(const ShapeValue& value) {
+        if (const Circle* c = std::get_if<Circle>(&value))
+            return addCircle(c->GetCenter(), c->GetRadius());
+        const Square& sq = std::get<Square>(value);
+        return addSquare(sq.GetCenter(), sq.GetSide());
+    }
+    ShapeHandle addValue(const SceneRecord& r) {
+        const Point c(r.x, r.y);
+        return r.type == static_cast<std::uint8_t>(ShapeType::Circle) ? addCircle(c, r.size) : addSquare(c, r.size);
+    }
+
+    void reserveShapes(std::size_t circleCount, std::size_t squareCount) {
+        switch (mode) {
+        case StorageMode::Packed:
+            circles.reserve(circles.count() + circleCount);
+            squares.reserve(squares.count() + squareCount);
+            circleSlots.reserve(circleSlots.size() + circleCount);
+            squareSlots.reserve(squareSlots.size() + squareCount);
+            break;
+        case StorageMode::Arena:
+            arenaShapes.reserve(arenaShapes.size() + circleCount + squareCount);
+            break;
+        case StorageMode::Variant:
+            variantShapes.reserve(variantShapes.size() + circleCount + squareCount);
+            break;
+        case StorageMode::Mapped:
+            extraRecords.reserve(extraRecords.size() + circleCount + squareCount);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Проверка предиката для removeIf() с учётом удаления в typeCounts
+    template <class Pred>
+    bool removeCounted(const Shape& shape, Pred& pred) {
+        if (!pred(shape))
+            return false;
+        --typeCounts[static_cast<std::size_t>(shape.GetTypeTag())];
+        return true;
+    }
+
+    template <class T, class Pred>
+    void removeIfInColumns(Pred& pred) {
+        ShapeColumns& cols = T::Tag == ShapeType::Circle ? circles : squares;
+        for (std::size_t i = 0; i < cols.count();) {
+            const T shape(Point(cols.x[i], cols.y[i]), cols.size[i]);
+            if (pred(static_cast<const Shape&>(shape)))
+                removeShape(T::Tag, i); // на место i встала последняя фигура, её тоже нужно проверить
+            else
+                ++i;
+        }
+    }
+
+    static std::uint64_t statsClock() {
+#if defined(CP_TRPO_DRAW_STATS)
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#else
+        return 0;
+#endif
+    }
+
+    void noteFrame() {
+#if defined(CP_TRPO_DRAW_STATS)
+        ++drawStats.frames;
+#endif
+    }
+
+    // Учитывает записанные за ns наносекунд команды; время делится между типами по числу команд
+    void noteShapes(std::uint64_t circleCount, std::uint64_t squareCount, std::uint64_t ns) {
+#if defined(CP_TRPO_DRAW_STATS)
+        const std::uint64_t total = circleCount + squareCount;
+        if (total == 0)
+            return;
+        const std::uint64_t circleNanos = ns * circleCount / total;
+        drawStats.shapes[static_cast<std::size_t>(ShapeType::Circle)] += circleCount;
+        drawStats.shapes[static_cast<std::size_t>(ShapeType::Square)] += squareCount;
+        drawStats.nanos[static_cast<std::size_t>(ShapeType::Circle)] += circleNanos;
+        drawStats.nanos[static_cast<std::size_t>(ShapeType::Square)] += ns - circleNanos;
+#else
+        (void)circleCount;
+        (void)squareCount;
+        (void)ns;
+#endif
+    }
+
+    // То же для команд buf, начиная с first: проход по кодам команд. Только для частичных кадров
+    // (окно, поток), пока они ещё в кэше; полный кадр берёт числа из typeCounts
+    void noteCommands(const CommandBuffer& buf, std::size_t first, std::uint64_t ns) {
+#if defined(CP_TRPO_DRAW_STATS)
+        const DrawCmd* cmds = buf.Commands().data();
+        std::uint64_t circleCount = 0;
+        std::uint64_t squareCount = 0;
+        for (std::size_t i = first; i < buf.Size(); ++i) {
+            circleCount += cmds[i].op == DrawOp::Circle;
+            squareCount += cmds[i].op == DrawOp::Square;
+        }
+        noteShapes(circleCount, squareCount, ns);
+#else
+        (void)buf;
+        (void)first;
+        (void)ns;
+#endif
+    }
+
+    template <class Record>
+    void measureRecord(CommandBuffer& buf, Record record) {
+        const std::size_t first = buf.Size();
+        const std::uint64_t start = statsClock();
+        record();
+        noteCommands(buf, first, statsClock() - start);
+    }
+
+    // Запись полного кадра сцены
+    template <class Record>
+    void measureFrame(Record record) {
+        const std::uint64_t start = statsClock();
+        record();
+#if defined(CP_TRPO_DRAW_STATS)
+        noteShapes(countOfType(ShapeType::Circle), countOfType(ShapeType::Square), statsClock() - start);
+#else
+        (void)start;
+#endif
+    }
+
+    void measureFlush(RenderSink& target) {
+        measureFlushWith(target, [&target] { target.Flush(); });
+    }
+
+    template <class Flush>
+    void measureFlushWith(RenderSink& target, Flush flush) {
+#if defined(CP_TRPO_DRAW_STATS)
+        const std::uint64_t flushes = target.FlushCount();
+        const std::uint64_t bytes = target.BytesWritten();
+        const std::uint64_t start = statsClock();
+        flush();
+        drawStats.flushNanos += statsClock() - start;
+        drawStats.flushes += target.FlushCount() - flushes;
+        drawStats.bytes += target.BytesWritten() - bytes;
+#else
+        (void)target;
+        flush();
+#endif
+    }
+
+    template <class T>
+    void refreshFrame(const ShapeColumns& cols, DirtySet& dirty, std::vector<DrawCmd>& frame) const {
+        const std::size_t n = cols.count();
+        if (!frameValid) {
+            frame.resize(n);
+            for (std::size_t i = 0; i < n; ++i)
+                frame[i] = T::CommandAt(Point(cols.x[i], cols.y[i]), cols.size[i]);
+        }
+        else {
+            // Новые фигуры всегда отмечены, поэтому после resize() все новые места будут заполнены
+            frame.resize(n);
+            for (std::uint32_t i : dirty.list)
+                if (i < n)
+                    frame[i] = T::CommandAt(Point(cols.x[i], cols.y[i]), cols.size[i]);
+        }
+        dirty.clear();
+    }
+
+    DirtySet& dirtyFor(ShapeType t) { return t == ShapeType::Circle ? circleDirty : squareDirty; }
+
+    void markDirty(ShapeType t, std::size_t index) {
+        if (trackingDirty)
+            dirtyFor(t).mark(index);
+    }
+
+    ShapeColumns* columnsFor(ShapeType t) {
+        return t == ShapeType::Circle ? &circles : t == ShapeType::Square ? &squares : nullptr;
+    }
+
+    static Rect boundsOf(ShapeType t, const ShapeColumns& cols, std::size_t i) {
+        const Point c(cols.x[i], cols.y[i]);
+        return t == ShapeType::Circle ? Circle::BoundsAt(c, cols.size[i]) : Square::BoundsAt(c, cols.size[i]);
+    }
+
+    // Обход объектов Shape в режимах List, Arena и Variant в порядке вставки
+    template <class F>
+    void forEachObject(F f) const {
+        switch (mode) {
+        case StorageMode::Arena:
+            for (ShapeRef<Shape> shape : arenaShapes)
+                f(static_cast<const Shape&>(*shape));
+            break;
+        case StorageMode::Variant:
+            for (const ShapeValue& value : variantShapes)
+                std::visit([&](const auto& shape) { f(static_cast<const Shape&>(shape)); }, value);
+            break;
+        case StorageMode::List:
+            for (const auto& shape : shapeList)
+                f(static_cast<const Shape&>(*shape));
+            break;
+        case StorageMode::Mapped:
+            forEachRecord([&f](const SceneRecord& r) { forRecordObject(r, f); });
+            break;
+        default:
+            break;
+        }
+    }
+
+    std::size_t mappedCount() const { return baseCount; }
+
+    // Радиус круга или сторона квадрата
+    static int sizeOf(const Shape& shape) {
+        return shape.GetTypeTag() == ShapeType::Circle ? static_cast<const Circle&>(shape).GetRadius()
+                                                       : static_cast<const Square&>(shape).GetSide();
+    }
+
+    // Записи режима Mapped в порядке рисования: сначала файл, затем добавленные
+    template <class F>
+    void forEachRecord(F f) const {
+        for (std::size_t i = 0; i < mappedCount(); ++i)
+            f(baseRecords[i]);
+        for (const SceneRecord& r : extraRecords)
+            f(r);
+    }
+
+    // Передаёт функции временный объект, собранный из записи; записи неизвестного типа пропускаются
+    template <class F>
+    static void forRecordObject(const SceneRecord& r, F& f) {
+        if (r.type == static_cast<std::uint8_t>(ShapeType::Circle)) {
+            const Circle shape(Point(r.x, r.y), r.size);
+            f(static_cast<const Shape&>(shape));
+        }
+        else if (r.type == static_cast<std::uint8_t>(ShapeType::Square)) {
+            const Square shape(Point(r.x, r.y), r.size);
+            f(static_cast<const Shape&>(shape));
+        }
+    }
+
+    // Плотный цикл по записям файла сцены, ветвление по тегу вместо виртуального вызова
+    static void recordRecords(const SceneRecord* records, std::size_t n, CommandBuffer& buf) {
+        for (std::size_t i = 0; i < n; ++i) {
+            const SceneRecord& r = records[i];
+            if (r.type == static_cast<std::uint8_t>(ShapeType::Circle))
+                Circle::DrawAt(buf, Point(r.x, r.y), r.size);
+            else if (r.type == static_cast<std::uint8_t>(ShapeType::Square))
+                Square::DrawAt(buf, Point(r.x, r.y), r.size);
+        }
+    }
+
+    void prepareChunkBuffers(std::size_t chunks) {
+        if (chunkBuffers.size() < chunks)
+            chunkBuffers.resize(chunks);
+        for (std::size_t c = 0; c < chunks; ++c)
+            chunkBuffers[c].Clear();
+    }
+
+    template <class T, class F>
+    static void forEachInColumns(const ShapeColumns& cols, F& f) {
+        for (std::size_t i = 0; i < cols.count(); ++i) {
+            const T shape(Point(cols.x[i], cols.y[i]), cols.size[i]);
+            f(static_cast<const Shape&>(shape));
+        }
+    }
+
+    // Делит хранилище с произвольным доступом на куски и рисует каждый в свой буфер, возвращает число кусков
+    template <class DrawOne>
+    std::size_t runIndexedChunks(WorkStealingPool& pool, std::size_t n, std::size_t chunkSize, DrawOne drawOne) {
+        const std::size_t chunks = (n + chunkSize - 1) / chunkSize;
+        prepareChunkBuffers(chunks);
+        pool.run(chunks, [&](std::size_t c) {
+            CommandBuffer& out = chunkBuffers[c];
+            const std::size_t last = std::min(n, (c + 1) * chunkSize);
+            for (std::size_t k = c * chunkSize; k < last; ++k)
+                drawOne(k, out);
+        });
+        return chunks;
+    }
+
+    // Плотный цикл по массивам одного типа: тип известен статически, виртуального вызова нет
+    template <class T>
+    static void recordColumns(const ShapeColumns& cols, CommandBuffer& buf,
+                              std::size_t first = 0, std::size_t count = SIZE_MAX) {
+        const std::size_t last = first + std::min(count, cols.count() - first);
+        const int* xs = cols.x.data();
+        const int* ys = cols.y.data();
+        const int* sizes = cols.size.data();
+        for (std::size_t i = first; i < last; ++i) {
+            T::DrawAt(buf, Point(xs[i], ys[i]), sizes[i]);
+        }
+    }
+};
+
+/*В исправленном коде добавлен виртуальный деструктор в базовый класс Shape,
+ *  чтобы обеспечить правильное удаление объектов при полиморфном использовании.
+ *  Класс DrwManager теперь использует список указателей на базовый класс Shape с помощью std::unique_ptr,
+ *  что позволяет автоматически управлять памятью объектов. В методе drawShapes вызывается полиморфная функция Draw,
+ *  которая рисует каждую фигуру соответствующим образом, и не требует изменений при добавлении новых типов фигур.
+*/
+#include <iostream>
+#include <string>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <cstdlib>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <iterator>
+#include <new>
+#include <array>
+#include <atomic>
+#include <stdexcept>
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+// Общая таблица строк: каждое имя хранится один раз, повторы получают ту же ссылку и номер.
+// Имена производителей и моделей сильно повторяются, поэтому таблица экономит и память, и копирования.
+// Добавление идёт под мьютексом, чтение по номеру (lookup) - без блокировки: ссылки на имена лежат
+// в кусках, которые после записи не перемещаются, а число опубликованных номеров атомарно.
+// Таблица ограничена capacity() именами и никогда не очищается: имена живут до конца программы
+class NameTable {
+public:
+    static constexpr std::size_t ChunkBits = 12;
+    static constexpr std::size_t ChunkSize = std::size_t(1) << ChunkBits;
+    static constexpr std::size_t MaxChunks = 256;
+    static constexpr std::size_t MaxCapacity = ChunkSize * MaxChunks;
+
+    explicit NameTable(std::size_t maxNames = MaxCapacity) : limit(std::min(maxNames, MaxCapacity)) {}
+
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    static NameTable& global() {
+        static NameTable table;
+        return table;
+    }
+
+    // Номер имени s; false, если имени ещё нет, а таблица заполнена
+    bool tryInternId(std::string_view s, std::uint32_t& id) {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = ids.find(s);
+        if (it != ids.end()) {
+            id = it->second;
+            return true;
+        }
+        const std::uint32_t next = published.load(std::memory_order_relaxed);
+        if (next >= limit)
+            return false;
+        storage.emplace_back(s); // deque не перемещает элементы при добавлении, ссылки остаются верными
+        const std::string_view stored = storage.back();
+        std::unique_ptr<std::string_view[]>& chunk = chunks[next >> ChunkBits];
+        if (!chunk)
+            chunk.reset(new std::string_view[ChunkSize]);
+        chunk[next & (ChunkSize - 1)] = stored;
+        ids.emplace(stored, next);
+        published.store(next + 1, std::memory_order_release);
+        id = next;
+        return true;
+    }
+
+    // Как tryInternId(), но заполненная таблица - ошибка: std::length_error
+    std::uint32_t internId(std::string_view s) {
+        std::uint32_t id;
+        if (!tryInternId(s, id))
+            throw std::length_error("NameTable: capacity exhausted");
+        return id;
+    }
+
+    // Без блокировки; для неизвестного номера пустая строка
+    std::string_view lookup(std::uint32_t id) const {
+        if (id >= published.load(std::memory_order_acquire))
+            return std::string_view();
+        return chunks[id >> ChunkBits][id & (ChunkSize - 1)];
+    }
+
+    std::size_t size() const { return published.load(std::memory_order_acquire); }
+    std::size_t capacity() const { return limit; }
+
+private:
+    const std::size_t limit;
+    std::mutex m; // добавление имён
+    std::deque<std::string> storage;
+    std::unordered_map<std::string_view, std::uint32_t> ids;
+    // Кусок выделяется до публикации первого своего номера и больше не меняется
+    std::unique_ptr<std::string_view[]> chunks[MaxChunks];
+    std::atomic<std::uint32_t> published{ 0 };
+};
+
+// Имя продукта. Пока имя передаётся в фабрику, оно может лишь ссылаться на строку вызывающего (без копии);
+// продукт сохраняет его через keep(): строка копируется один раз либо уже лежит в общей таблице NameTable.
+// Занимает 16 байт: указатель и длина, а сохранённое имя до InlineCapacity символов лежит прямо в объекте,
+// более длинное - в отдельном буфере точного размера; длинная временная std::string забирается целиком
+class PhoneName {
+public:
+    static const std::size_t InlineCapacity = 15;
+
+    PhoneName(const char* s) : PhoneName(std::string_view(s)) {}
+    PhoneName(std::string_view s) { setRef(s, Borrowed); }
+    PhoneName(const std::string& s) : PhoneName(std::string_view(s)) {}
+    // Временная строка не переживёт вызов. Короткая копируется в объект, у длинной забирается буфер:
+    // символы не копируются, выделяется только сам объект std::string
+    PhoneName(std::string&& s) {
+        if (s.size() <= InlineCapacity) {
+            setOwned(s);
+            return;
+        }
+        std::string* adopted = new std::string(std::move(s));
+        std::memcpy(storage, &adopted, sizeof(adopted));
+        setMeta(Owned, false, 1);
+    }
+
+    PhoneName(const PhoneName& o) {
+        if (o.state() == Owned && !o.isInline())
+            setOwned(o.view());
+        else
+            std::memcpy(storage, o.storage, sizeof(storage));
+    }
+    PhoneName(PhoneName&& o) noexcept {
+        std::memcpy(storage, o.storage, sizeof(storage));
+        o.setRef(std::string_view(), Borrowed);
+    }
+    PhoneName& operator=(PhoneName o) noexcept {
+        char tmp[sizeof(storage)];
+        std::memcpy(tmp, storage, sizeof(storage));
+        std::memcpy(storage, o.storage, sizeof(storage));
+        std::memcpy(o.storage, tmp, sizeof(storage));
+        return *this;
+    }
+    ~PhoneName() {
+        if (state() == Owned && !isInline()) {
+            if (isAdopted())
+                delete adoptedString();
+            else
+                delete[] data();
+        }
+    }
+
+    // Имя из общей таблицы; если таблица заполнена, а имени в ней нет - собственная копия
+    static PhoneName Interned(std::string_view s) {
+        NameTable& table = NameTable::global();
+        std::uint32_t id;
+        if (!table.tryInternId(s, id))
+            return PhoneName(s).keep();
+        PhoneName name(table.lookup(id));
+        name.setMeta(FromTable, false, 0);
+        return name;
+    }
+
+    // Ссылка на строку, которая заведомо переживёт продукт (например, хранится в том же блоке памяти)
+    static PhoneName Unowned(std::string_view s) {
+        PhoneName name(s);
+        name.setMeta(Stable, false, 0);
+        return name;
+    }
+
+    std::string_view view() const {
+        if (isInline())
+            return std::string_view(storage, meta() >> 3);
+        if (isAdopted())
+            return *adoptedString();
+        return std::string_view(data(), length());
+    }
+    bool isInterned() const { return state() == FromTable; }
+
+    // Имя, не зависящее от строки вызывающего
+    PhoneName keep() && {
+        if (state() == Borrowed)
+            setOwned(view());
+        return std::move(*this);
+    }
+
+private:
+    enum State : std::uint8_t { Borrowed, Owned, FromTable, Stable };
+
+    // Последний байт: биты 0-1 - State, бит 2 - символы лежат в storage, биты 3-7 - их число.
+    // Иначе в начале storage лежат указатель и 32-битная длина, а бит 3 означает, что указатель -
+    // на забранную std::string (длина тогда не хранится)
+    std::uint8_t meta() const { return static_cast<std::uint8_t>(storage[sizeof(storage) - 1]); }
+    State state() const { return static_cast<State>(meta() & 3); }
+    bool isInline() const { return (meta() & 4) != 0; }
+    bool isAdopted() const { return (meta() & 12) == 8; }
+    void setMeta(State st, bool local, std::size_t n) {
+        storage[sizeof(storage) - 1] = static_cast<char>(st | (local ? 4 : 0) | (n << 3));
+    }
+
+    const char* data() const {
+        const char* p;
+        std::memcpy(&p, storage, sizeof(p));
+        return p;
+    }
+    std::string* adoptedString() const {
+        std::string* p;
+        std::memcpy(&p, storage, sizeof(p));
+        return p;
+    }
+    std::uint32_t length() const {
+        std::uint32_t n;
+        std::memcpy(&n, storage + sizeof(const char*), sizeof(n));
+        return n;
+    }
+
+    void setRef(std::string_view s, State st) {
+        const char* p = s.data();
+        const std::uint32_t n = static_cast<std::uint32_t>(s.size());
+        std::memcpy(storage, &p, sizeof(p));
+        std::memcpy(storage + sizeof(p), &n, sizeof(n));
+        setMeta(st, false, 0);
+    }
+
+    // Копия символов s; s может указывать на собственный storage, поэтому он переписывается последним
+    void setOwned(std::string_view s) {
+        if (s.size() <= InlineCapacity) {
+            char local[InlineCapacity];
+            std::memcpy(local, s.data(), s.size());
+            std::memcpy(storage, local, s.size());
+            setMeta(Owned, true, s.size());
+            return;
+        }
+        char* copy = new char[s.size()];
+        std::memcpy(copy, s.data(), s.size());
+        setRef(std::string_view(copy, s.size()), Owned);
+    }
+
+    alignas(const char*) char storage[16];
+};
+static_assert(sizeof(PhoneName) == 16, "PhoneName must stay two words");
+
+// интерфейс Phone
+class Phone {
+public:
+    virtual ~Phone() {}
+    virtual std::string_view getName() const = 0;
+};
+
+// Абстрактный продукт Smartphone, наследующийся от Phone
+class Smartphone : public Phone {
+};
+
+// Абстрактный продукт BasicPhone, наследующийся от Phone
+class BasicPhone : public Phone {
+};
+
+// Вид продукта фабрики
+enum class PhoneKind : std::uint8_t {
+    Smartphone,
+    BasicPhone
+};
+
+// Номер производителя в реестре фабрик
+using BrandId = std::uint16_t;
+
+// Отложенный продукт: номер производителя, вид продукта и имя, обычно ссылка на строку в NameTable.
+// Метаданные (getName(), вид, производитель) отвечаются без создания объекта; полный продукт создаётся
+// фабрикой производителя из реестра только при materialize().
+// Когда NameTable заполнена, новое имя хранится собственной копией (PhoneName::Interned()):
+// создание не падает, а лишь перестаёт экономить память на повторах
+class LazyPhone final : public Phone {
+public:
+    LazyPhone(BrandId b, PhoneKind k, PhoneName n) : name(std::move(n)), brandId(b), productKind(k) {}
+
+    std::string_view getName() const override { return name.view(); }
+
+    BrandId brand() const { return brandId; }
+    PhoneKind kind() const { return productKind; }
+    bool isInterned() const { return name.isInterned(); }
+    std::string_view manufacturer() const;
+
+    // Создаёт полный продукт (Smartphone или BasicPhone по kind()); имя берётся из таблицы без копии.
+    // std::out_of_range, если производитель не зарегистрирован
+    std::unique_ptr<Phone> materialize() const;
+
+private:
+    PhoneName name;
+    BrandId brandId;
+    PhoneKind productKind;
+};
+
+// Описание продукта, известное при компиляции: literal-тип, имя хранится в самом описании.
+// constexpr-описания и каталоги из них (std::array) лежат в данных только для чтения: ни кода запуска,
+// ни выделений памяти. Объект продукта создаётся фабрикой из реестра только при materialize()
+struct PhoneDescriptor {
+    static constexpr std::size_t NameCapacity = 31;
+
+    BrandId brand = 0;
+    PhoneKind kind = PhoneKind::Smartphone;
+    std::string_view manufacturer;
+    char text[NameCapacity] = {};
+    std::uint8_t length = 0;
+
+    // Имя - склейка first и second. Длиннее NameCapacity - std::length_error,
+    // при вычислении в constexpr это ошибка компиляции
+    static constexpr PhoneDescriptor Make(BrandId b, PhoneKind k, std::string_view man, std::string_view first,
+                                          std::string_view second = std::string_view()) {
+        if (first.size() + second.size() > NameCapacity)
+            throw std::length_error("PhoneDescriptor: name is too long");
+        PhoneDescriptor d;
+        d.brand = b;
+        d.kind = k;
+        d.manufacturer = man;
+        for (char c : first)
+            d.text[d.length++] = c;
+        for (char c : second)
+            d.text[d.length++] = c;
+        return d;
+    }
+
+    constexpr std::string_view name() const { return std::string_view(text, length); }
+
+    // std::out_of_range, если производитель не зарегистрирован
+    std::unique_ptr<Phone> materialize() const;
+};
+
+// Счётчики пула продуктов, по ним подбирается размер пула
+struct PoolStats {
+    std::uint64_t hits = 0;     // блок взят из свободного списка
+    std::uint64_t misses = 0;   // свободных блоков не было, память выделена заново
+    std::uint64_t releases = 0; // блок вернулся в свободный список
+    std::uint64_t trimmed = 0;  // блок освобождён, потому что свободный список заполнен, или вызовом trim()
+    std::size_t freeBlocks = 0; // блоков в свободном списке сейчас
+};
+
+// Пул блоков памяти для продуктов. Продукт вместе с блоком управления shared_ptr размещается
+// в одном блоке пула (через std::allocate_shared), последний владелец возвращает блок в свободный список.
+// Размер блока фиксируется первым выделением; запросы другого размера идут мимо пула.
+// Состояние пула удаляется, когда уничтожен сам пул и вернулись все выданные блоки,
+// поэтому пул можно уничтожить раньше продуктов
+class ProductPool {
+    struct State {
+        std::mutex m;
+        std::vector<void*> freeList;
+        std::size_t blockSize = 0;
+        std::size_t maxFree;
+        std::size_t outstanding = 0; // выданные и ещё не вернувшиеся блоки
+        bool poolAlive = true;
+        PoolStats stats;
+
+        explicit State(std::size_t limit) : maxFree(limit) {}
+        ~State() {
+            for (void* block : freeList)
+                std::free(block);
+        }
+
+        void* allocate(std::size_t size) {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                ++outstanding;
+                if (blockSize == 0)
+                    blockSize = size;
+                if (size == blockSize && !freeList.empty()) {
+                    void* block = freeList.back();
+                    freeList.pop_back();
+                    ++stats.hits;
+                    return block;
+                }
+                ++stats.misses;
+            }
+            if (void* block = std::malloc(size))
+                return block;
+            release(nullptr, size);
+            throw std::bad_alloc();
+        }
+
+        void release(void* block, std::size_t size) {
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                --outstanding;
+                last = !poolAlive && outstanding == 0;
+                if (block && !last && size == blockSize && freeList.size() < maxFree) {
+                    freeList.push_back(block);
+                    ++stats.releases;
+                    return;
+                }
+                // Вытесненным считается только блок пула, не поместившийся в заполненный список;
+                // блоки другого размера и блоки после уничтожения пула просто освобождаются
+                if (block && !last && size == blockSize && freeList.size() >= maxFree)
+                    ++stats.trimmed;
+            }
+            std::free(block);
+            if (last)
+                delete this;
+        }
+
+        // Вызывается из деструктора пула
+        void detach() {
+            bool last;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                poolAlive = false;
+                last = outstanding == 0;
+            }
+            if (last)
+                delete this;
+        }
+    };
+
+public:
+    // Аллокатор для std::allocate_shared, берущий память из пула. Копируется как простой указатель
+    template <class U>
+    struct Allocator {
+        using value_type = U;
+
+        State* state;
+
+        explicit Allocator(State* s) : state(s) {}
+        template <class V>
+        Allocator(const Allocator<V>& other) : state(other.state) {}
+
+        U* allocate(std::size_t n) { return static_cast<U*>(state->allocate(n * sizeof(U))); }
+        void deallocate(U* p, std::size_t n) { state->release(p, n * sizeof(U)); }
+
+        template <class V>
+        bool operator==(const Allocator<V>& other) const { return state == other.state; }
+        template <class V>
+        bool operator!=(const Allocator<V>& other) const { return state != other.state; }
+    };
+
+    explicit ProductPool(std::size_t maxFree = 4096) : state(new State(maxFree)) {}
+    ~ProductPool() { state->detach(); }
+
+    ProductPool(const ProductPool&) = delete;
+    ProductPool& operator=(const ProductPool&) = delete;
+
+    template <class T, class... Args>
+    std::shared_ptr<T> make(Args&&... args) {
+        return std::allocate_shared<T>(Allocator<T>(state), std::forward<Args>(args)...);
+    }
+
+    PoolStats stats() const {
+        std::lock_guard<std::mutex> lock(state->m);
+        PoolStats result = state->stats;
+        result.freeBlocks = state->freeList.size();
+        return result;
+    }
+
+    // Возвращает системе все свободные блоки
+    void trim() {
+        std::vector<void*> blocks;
+        {
+            std::lock_guard<std::mutex> lock(state->m);
+            blocks.swap(state->freeList);
+            state->stats.trimmed += blocks.size();
+        }
+        for (void* block : blocks)
+            std::free(block);
+    }
+
+private:
+    State* state;
+};
+
+// Кэш блоков памяти текущего потока для продуктов LocalProduct: свой набор свободных списков
+// по классам размеров в каждом потоке, без мьютексов и атомарных операций. Блок, освобождённый
+// в другом потоке, попадает в кэш того потока. После завершения потока блоки идут прямо в malloc/free
+class ThreadProductCache {
+public:
+    static const std::size_t Granularity = 16;
+    static const std::size_t MaxBlock = 256; // блоки крупнее идут мимо кэша
+    static const std::size_t MaxFree = 4096; // свободных блоков на класс размера
+
+    static void* allocate(std::size_t size) {
+        Cache* cache = local();
+        if (cache && size <= MaxBlock) {
+            std::vector<void*>& list = cache->free[classOf(size)];
+            if (!list.empty()) {
+                void* block = list.back();
+                list.pop_back();
+                ++cache->stats.hits;
+                return block;
+            }
+            ++cache->stats.misses;
+        }
+        if (void* block = std::malloc(size <= MaxBlock ? roundUp(size) : size))
+            return block;
+        throw std::bad_alloc();
+    }
+
+    static void release(void* block, std::size_t size) {
+        Cache* cache = local();
+        if (cache && size <= MaxBlock) {
+            std::vector<void*>& list = cache->free[classOf(size)];
+            if (list.size() < MaxFree) {
+                list.push_back(block);
+                ++cache->stats.releases;
+                return;
+            }
+            ++cache->stats.trimmed;
+        }
+        std::free(block);
+    }
+
+    // Счётчики кэша вызывающего потока
+    static PoolStats stats() {
+        PoolStats result;
+        if (Cache* cache = local()) {
+            result = cache->stats;
+            for (const std::vector<void*>& list : cache->free)
+                result.freeBlocks += list.size();
+        }
+        return result;
+    }
+
+    // Возвращает системе свободные блоки вызывающего потока
+    static void trim() {
+        if (Cache* cache = local())
+            cache->stats.trimmed += cache->freeAll();
+    }
+
+private:
+    static std::size_t roundUp(std::size_t size) { return (size + Granularity - 1) / Granularity * Granularity; }
+    static std::size_t classOf(std::size_t size) { return size ? (size - 1) / Granularity : 0; }
+
+    struct Cache {
+        std::vector<void*> free[MaxBlock / Granularity];
+        PoolStats stats;
+
+        Cache() { current = this; }
+        ~Cache() {
+            freeAll();
+            current = nullptr;
+            finished = true;
+        }
+
+        std::size_t freeAll() {
+            std::size_t n = 0;
+            for (std::vector<void*>& list : free) {
+                for (void* block : list)
+                    std::free(block);
+                n += list.size();
+                list.clear();
+            }
+            return n;
+        }
+    };
+
+    // nullptr, если кэш потока уже разрушен (освобождение из деструкторов thread_local объектов)
+    static Cache* local() {
+        if (current)
+            return current;
+        if (finished)
+            return nullptr;
+        thread_local Cache cache;
+        return &cache;
+    }
+
+    static inline thread_local Cache* current = nullptr;
+    static inline thread_local bool finished = false;
+};
+
+// Продукт с единственным владельцем, размещённый в ThreadProductCache. В отличие от shared_ptr
+// не содержит счётчика ссылок: создание, перемещение и удаление не выполняют атомарных операций.
+// Для передачи нескольким владельцам продукт превращается в shared_ptr через share()
+template <class T>
+class LocalProduct {
+public:
+    LocalProduct() = default;
+    LocalProduct(LocalProduct&& o) noexcept : ptr(o.ptr), block(o.block), bytes(o.bytes) { o.ptr = nullptr; }
+    template <class U>
+    LocalProduct(LocalProduct<U>&& o) noexcept : ptr(o.ptr), block(o.block), bytes(o.bytes) {
+        o.ptr = nullptr;
+    }
+    LocalProduct& operator=(LocalProduct&& o) noexcept {
+        if (this != &o) {
+            reset();
+            ptr = o.ptr;
+            block = o.block;
+            bytes = o.bytes;
+            o.ptr = nullptr;
+        }
+        return *this;
+    }
+    ~LocalProduct() { reset(); }
+
+    template <class... Args>
+    static LocalProduct Make(Args&&... args) {
+        void* block = ThreadProductCache::allocate(sizeof(T));
+        T* p;
+        try {
+            p = new (block) T(std::forward<Args>(args)...);
+        } catch (...) {
+            ThreadProductCache::release(block, sizeof(T));
+            throw;
+        }
+        LocalProduct result;
+        result.ptr = p;
+        result.block = block;
+        result.bytes = sizeof(T);
+        return result;
+    }
+
+    void reset() {
+        if (ptr) {
+            ptr->~T();
+            ThreadProductCache::release(block, bytes);
+            ptr = nullptr;
+        }
+    }
+
+    T* get() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    T* operator->() const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+    // Передача в общее владение: выделяется блок управления shared_ptr, дальше - атомарный счётчик
+    std::shared_ptr<T> share() && {
+        if (!ptr)
+            return nullptr;
+        void* b = block;
+        const std::size_t n = bytes;
+        std::shared_ptr<T> result(ptr, [b, n](T* p) {
+            p->~T();
+            ThreadProductCache::release(b, n);
+        });
+        ptr = nullptr;
+        return result;
+    }
+
+private:
+    template <class U>
+    friend class LocalProduct;
+
+    T* ptr = nullptr;
+    void* block = nullptr; // начало блока: для базового T может не совпадать с ptr
+    std::size_t bytes = 0;
+};
+
+// Владеющий указатель на продукт со встроенным неатомарным счётчиком ссылок: счётчик лежит в заголовке
+// прямо перед объектом, в том же блоке памяти, сам указатель - одно слово. Копирование - обычный инкремент,
+// поэтому хендлы не делятся между потоками: все копии одного продукта должны жить в одном потоке.
+// Для продукта, который нужен нескольким потокам, - std::shared_ptr (createSmartphone())
+template <class T>
+class PhoneHandle {
+    static_assert(std::is_polymorphic<T>::value, "PhoneHandle needs a polymorphic product type");
+
+public:
+    PhoneHandle() = default;
+    PhoneHandle(const PhoneHandle& o) noexcept : ptr(o.ptr) { retain(); }
+    template <class U>
+    PhoneHandle(const PhoneHandle<U>& o) noexcept : ptr(o.ptr) { retain(); }
+    PhoneHandle(PhoneHandle&& o) noexcept : ptr(o.ptr) { o.ptr = nullptr; }
+    template <class U>
+    PhoneHandle(PhoneHandle<U>&& o) noexcept : ptr(o.ptr) { o.ptr = nullptr; }
+    PhoneHandle& operator=(PhoneHandle o) noexcept {
+        std::swap(ptr, o.ptr);
+        return *this;
+    }
+    ~PhoneHandle() { reset(); }
+
+    template <class... Args>
+    static PhoneHandle Make(Args&&... args) {
+        static_assert(alignof(T) <= sizeof(std::size_t), "product is over-aligned for the handle header");
+        void* block = ::operator new(sizeof(std::size_t) + sizeof(T));
+        std::size_t* refs = static_cast<std::size_t*>(block);
+        PhoneHandle result;
+        try {
+            result.ptr = new (refs + 1) T(std::forward<Args>(args)...);
+        } catch (...) {
+            ::operator delete(block);
+            throw;
+        }
+        *refs = 1;
+        return result;
+    }
+
+    void reset() noexcept {
+        if (ptr && --*counter() == 0) {
+            std::size_t* refs = counter();
+            ptr->~T();
+            ::operator delete(refs);
+        }
+        ptr = nullptr;
+    }
+
+    std::size_t useCount() const { return ptr ? *counter() : 0; }
+
+    T* get() const { return ptr; }
+    T& operator*() const { return *ptr; }
+    T* operator->() const { return ptr; }
+    explicit operator bool() const { return ptr != nullptr; }
+
+private:
+    template <class U>
+    friend class PhoneHandle;
+
+    void retain() noexcept {
+        if (ptr)
+            ++*counter();
+    }
+
+    // Заголовок стоит перед полным объектом; dynamic_cast<void*> находит его начало и через указатель на базу
+    std::size_t* counter() const {
+        return static_cast<std::size_t*>(const_cast<void*>(dynamic_cast<const void*>(ptr))) - 1;
+    }
+
+    T* ptr = nullptr;
+};
+
+// Список имён для пакетного создания продуктов
+#if defined(__cpp_lib_span)
+using NameSpan = std::span<const std::string_view>;
+#else
+// Замена std::span<const std::string_view> для сборки в режиме C++17
+class NameSpan {
+public:
+    NameSpan() = default;
+    NameSpan(const std::string_view* p, std::size_t n) : ptr(p), count(n) {}
+    NameSpan(const std::vector<std::string_view>& v) : ptr(v.data()), count(v.size()) {}
+    template <std::size_t N>
+    NameSpan(const std::string_view (&a)[N]) : ptr(a), count(N) {}
+
+    const std::string_view* data() const { return ptr; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const std::string_view& operator[](std::size_t i) const { return ptr[i]; }
+    const std::string_view* begin() const { return ptr; }
+    const std::string_view* end() const { return ptr + count; }
+
+private:
+    const std::string_view* ptr = nullptr;
+    std::size_t count = 0;
+};
+#endif
+
+// Пачка продуктов, созданных одним вызовом фабрики. Все объекты и, если имена не интернированы,
+// копии их имён лежат в одном непрерывном блоке памяти - одно выделение на пачку.
+// Элементы доступны как диапазон ссылок на базовый тип
+template <class Base>
+class ProductBatch {
+public:
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Base;
+        using difference_type = std::ptrdiff_t;
+        using pointer = Base*;
+        using reference = Base&;
+
+        iterator(const ProductBatch* b, std::size_t i) : batch(b), index(i) {}
+        Base& operator*() const { return (*batch)[index]; }
+        Base* operator->() const { return &(*batch)[index]; }
+        iterator& operator++() {
+            ++index;
+            return *this;
+        }
+        bool operator==(const iterator& o) const { return index == o.index; }
+        bool operator!=(const iterator& o) const { return index != o.index; }
+
+    private:
+        const ProductBatch* batch;
+        std::size_t index;
+    };
+
+    ProductBatch() = default;
+    ProductBatch(ProductBatch&& o) noexcept { swap(o); }
+    ProductBatch& operator=(ProductBatch&& o) noexcept {
+        ProductBatch tmp(std::move(o));
+        swap(tmp);
+        return *this;
+    }
+    ~ProductBatch() {
+        if (block) {
+            destroy(block, count);
+            ::operator delete(block);
+        }
+    }
+
+    // Создаёт по продукту T на каждое имя. С intern == true имена берутся из NameTable,
+    // иначе копируются в хвост того же блока
+    template <class T>
+    static ProductBatch Make(NameSpan names, bool intern) {
+        const std::size_t n = names.size();
+        ProductBatch batch;
+        if (n == 0)
+            return batch;
+        std::size_t chars = 0;
+        if (!intern)
+            for (std::string_view name : names)
+                chars += name.size();
+        batch.block = ::operator new(n * sizeof(T) + chars);
+        batch.stride = sizeof(T);
+        batch.destroy = [](void* p, std::size_t count) {
+            T* items = static_cast<T*>(p);
+            for (std::size_t i = count; i-- > 0;)
+                items[i].~T();
+        };
+        T* items = static_cast<T*>(batch.block);
+        char* text = static_cast<char*>(batch.block) + n * sizeof(T);
+        for (std::string_view name : names) {
+            PhoneName stored = intern ? PhoneName::Interned(name) : PhoneName::Unowned(std::string_view(text, name.size()));
+            if (!intern) {
+                std::copy(name.begin(), name.end(), text);
+                text += name.size();
+            }
+            new (items + batch.count) T(std::move(stored));
+            ++batch.count; // деструктор пачки разрушит только уже созданные объекты
+        }
+        batch.offset = reinterpret_cast<char*>(static_cast<Base*>(items)) - reinterpret_cast<char*>(items);
+        return batch;
+    }
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    Base& operator[](std::size_t i) const {
+        return *reinterpret_cast<Base*>(static_cast<char*>(block) + i * stride + offset);
+    }
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, count); }
+
+private:
+    void swap(ProductBatch& o) noexcept {
+        std::swap(block, o.block);
+        std::swap(count, o.count);
+        std::swap(stride, o.stride);
+        std::swap(offset, o.offset);
+        std::swap(destroy, o.destroy);
+    }
+
+    void* block = nullptr;
+    std::size_t count = 0;
+    std::size_t stride = 0;
+    std::ptrdiff_t offset = 0; // смещение подобъекта Base внутри конкретного типа
+    void (*destroy)(void*, std::size_t) = nullptr;
+};
+
+// Абстрактная фабрика PhoneFactory.
+// Методы create* можно вызывать из нескольких потоков одновременно, настройки (setPooling, setNameInterning)
+// задаются до начала такой работы. Пул и таблица имён общие для потоков и защищены мьютексами;
+// createLocal* работает только с кэшем вызывающего потока
+class PhoneFactory {
+public:
+    virtual ~PhoneFactory() {}
+
+    // Имя принимается как PhoneName: строковые литералы, string_view и std::string передаются без копии,
+    // продукт копирует имя один раз (короткое - без выделения памяти)
+    virtual std::shared_ptr<Smartphone> createSmartphone(PhoneName name) = 0;
+    virtual std::shared_ptr<BasicPhone> createBasicPhone(PhoneName name) = 0;
+
+    // Пакетное создание: один виртуальный вызов и одно выделение памяти на всю пачку
+    virtual ProductBatch<Smartphone> createSmartphones(NameSpan names) = 0;
+    virtual ProductBatch<BasicPhone> createBasicPhones(NameSpan names) = 0;
+
+    // Продукты с единственным владельцем из кэша памяти вызывающего потока: без общих блокировок
+    // и атомарных счётчиков ссылок (кроме таблицы имён при включённом интернировании)
+    virtual LocalProduct<Smartphone> createLocalSmartphone(PhoneName name) = 0;
+    virtual LocalProduct<BasicPhone> createLocalBasicPhone(PhoneName name) = 0;
+
+    // Продукты с одним владельцем - через unique_ptr: без блока управления shared_ptr.
+    // Для нескольких владельцев в одном потоке - PhoneHandle с неатомарным счётчиком
+    virtual std::unique_ptr<Smartphone> createUniqueSmartphone(PhoneName name) = 0;
+    virtual std::unique_ptr<BasicPhone> createUniqueBasicPhone(PhoneName name) = 0;
+    virtual PhoneHandle<Smartphone> createSmartphoneHandle(PhoneName name) = 0;
+    virtual PhoneHandle<BasicPhone> createBasicPhoneHandle(PhoneName name) = 0;
+
+    // Отложенные продукты: имя интернируется, объект не создаётся, пока не вызван LazyPhone::materialize().
+    // Если NameTable заполнена, имя копируется в продукт; исключений из-за таблицы нет
+    virtual LazyPhone createLazySmartphone(std::string_view name) = 0;
+    virtual LazyPhone createLazyBasicPhone(std::string_view name) = 0;
+
+    // По умолчанию продукты создаются через make_shared; с включённым пулом блоки
+    // освободившихся продуктов используются повторно
+    void setPooling(bool on) { pooling = on; }
+    bool isPooling() const { return pooling; }
+
+    PoolStats getPoolStats(PhoneKind kind) const {
+        return kind == PhoneKind::Smartphone ? smartphonePool.stats() : basicPhonePool.stats();
+    }
+
+    void trimPools() {
+        smartphonePool.trim();
+        basicPhonePool.trim();
+    }
+
+    // С включённым интернированием имена продуктов хранятся в общей таблице NameTable,
+    // повторяющееся имя не выделяет память
+    void setNameInterning(bool on) { internNames = on; }
+    bool isNameInterning() const { return internNames; }
+
+protected:
+    // Создание продукта с учётом настроек пула и интернирования
+    template <class T>
+    std::shared_ptr<T> makeProduct(PhoneKind kind, PhoneName name) {
+        applyInterning(name);
+        if (!pooling)
+            return std::make_shared<T>(std::move(name));
+        ProductPool& pool = kind == PhoneKind::Smartphone ? smartphonePool : basicPhonePool;
+        return pool.make<T>(std::move(name));
+    }
+
+    template <class T>
+    LocalProduct<T> makeLocal(PhoneName name) {
+        applyInterning(name);
+        return LocalProduct<T>::Make(std::move(name));
+    }
+
+    template <class T>
+    std::unique_ptr<T> makeUnique(PhoneName name) {
+        applyInterning(name);
+        return std::unique_ptr<T>(new T(std::move(name)));
+    }
+
+    template <class T>
+    PhoneHandle<T> makeHandle(PhoneName name) {
+        applyInterning(name);
+        return PhoneHandle<T>::Make(std::move(name));
+    }
+
+    template <class T, class Base>
+    ProductBatch<Base> makeBatch(NameSpan names) {
+        return ProductBatch<Base>::template Make<T>(names, internNames);
+    }
+
+private:
+    void applyInterning(PhoneName& name) const {
+        if (internNames && !name.isInterned())
+            name = PhoneName::Interned(name.view());
+    }
+
+    bool pooling = false;
+    bool internNames = false;
+    ProductPool smartphonePool;
+    ProductPool basicPhonePool;
+};
+
+// Конкретный продукт NokiaSmartphone, наследующийся от Smartphone
+class NokiaSmartphone final : public Smartphone {
+    PhoneName name;
+
+public:
+    NokiaSmartphone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Конкретный продукт NokiaBasicPhone, наследующийся от BasicPhone
+class NokiaBasicPhone final : public BasicPhone {
+    PhoneName name;
+
+public:
+    NokiaBasicPhone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Конкретный продукт SamsungSmartphone, наследующийся от Smartphone
+class SamsungSmartphone final : public Smartphone {
+    PhoneName name;
+
+public:
+    SamsungSmartphone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Конкретный продукт SamsungBasicPhone, наследующийся от BasicPhone
+class SamsungBasicPhone final : public BasicPhone {
+    PhoneName name;
+
+public:
+    SamsungBasicPhone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Конкретный продукт HTCSmartphone, наследующийся от Smartphone
+class HTCSmartphone final : public Smartphone {
+    PhoneName name;
+
+public:
+    HTCSmartphone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Конкретный продукт HTCBasicPhone, наследующийся от BasicPhone
+class HTCBasicPhone final : public BasicPhone {
+    PhoneName name;
+
+public:
+    HTCBasicPhone(PhoneName n) : name(std::move(n).keep()) {}
+
+    std::string_view getName() const override {
+        return name.view();
+    }
+};
+
+// Описания производителей: конкретные типы продуктов, название бренда и номер в реестре фабрик
+struct NokiaBrand {
+    using Smartphone = NokiaSmartphone;
+    using BasicPhone = NokiaBasicPhone;
+    static constexpr std::string_view Name = "Nokia";
+    static constexpr std::uint16_t Id = 0;
+};
+
+struct SamsungBrand {
+    using Smartphone = SamsungSmartphone;
+    using BasicPhone = SamsungBasicPhone;
+    static constexpr std::string_view Name = "Samsung";
+    static constexpr std::uint16_t Id = 1;
+};
+
+struct HTCBrand {
+    using Smartphone = HTCSmartphone;
+    using BasicPhone = HTCBasicPhone;
+    static constexpr std::string_view Name = "HTC";
+    static constexpr std::uint16_t Id = 2;
+};
+
+// Фабрика времени компиляции для известного заранее производителя: без vtable у фабрики,
+// без создания объекта фабрики, продукты возвращаются по значению своего конкретного (final) типа,
+// поэтому и их вызовы не виртуальные
+template <class Brand>
+class StaticPhoneFactory {
+public:
+    using SmartphoneType = typename Brand::Smartphone;
+    using BasicPhoneType = typename Brand::BasicPhone;
+
+    static constexpr std::string_view manufacturer() { return Brand::Name; }
+
+    static constexpr PhoneDescriptor describeSmartphone(std::string_view name) {
+        return PhoneDescriptor::Make(Brand::Id, PhoneKind::Smartphone, Brand::Name, name);
+    }
+
+    static constexpr PhoneDescriptor describeBasicPhone(std::string_view name) {
+        return PhoneDescriptor::Make(Brand::Id, PhoneKind::BasicPhone, Brand::Name, name);
+    }
+
+    // Стандартная пара продуктов производителя: "<производитель> Smartphone" и "<производитель> Basic Phone"
+    static constexpr std::array<PhoneDescriptor, 2> catalog() {
+        return { PhoneDescriptor::Make(Brand::Id, PhoneKind::Smartphone, Brand::Name, Brand::Name, " Smartphone"),
+                 PhoneDescriptor::Make(Brand::Id, PhoneKind::BasicPhone, Brand::Name, Brand::Name, " Basic Phone") };
+    }
+
+    static SmartphoneType createSmartphone(PhoneName name) { return SmartphoneType(std::move(name)); }
+    static BasicPhoneType createBasicPhone(PhoneName name) { return BasicPhoneType(std::move(name)); }
+
+    static ProductBatch<SmartphoneType> createSmartphones(NameSpan names, bool intern = false) {
+        return ProductBatch<SmartphoneType>::template Make<SmartphoneType>(names, intern);
+    }
+
+    static ProductBatch<BasicPhoneType> createBasicPhones(NameSpan names, bool intern = false) {
+        return ProductBatch<BasicPhoneType>::template Make<BasicPhoneType>(names, intern);
+    }
+};
+
+// Тонкий адаптер: реализация интерфейса PhoneFactory поверх StaticPhoneFactory<Brand>
+template <class Brand>
+class BrandPhoneFactory : public PhoneFactory {
+public:
+    using Static = StaticPhoneFactory<Brand>;
+
+    std::shared_ptr<Smartphone> createSmartphone(PhoneName name) override {
+        return makeProduct<typename Static::SmartphoneType>(PhoneKind::Smartphone, std::move(name));
+    }
+
+    std::shared_ptr<BasicPhone> createBasicPhone(PhoneName name) override {
+        return makeProduct<typename Static::BasicPhoneType>(PhoneKind::BasicPhone, std::move(name));
+    }
+
+    ProductBatch<Smartphone> createSmartphones(NameSpan names) override {
+        return makeBatch<typename Static::SmartphoneType, Smartphone>(names);
+    }
+
+    ProductBatch<BasicPhone> createBasicPhones(NameSpan names) override {
+        return makeBatch<typename Static::BasicPhoneType, BasicPhone>(names);
+    }
+
+    LocalProduct<Smartphone> createLocalSmartphone(PhoneName name) override {
+        return makeLocal<typename Static::SmartphoneType>(std::move(name));
+    }
+
+    LocalProduct<BasicPhone> createLocalBasicPhone(PhoneName name) override {
+        return makeLocal<typename Static::BasicPhoneType>(std::move(name));
+    }
+
+    std::unique_ptr<Smartphone> createUniqueSmartphone(PhoneName name) override {
+        return makeUnique<typename Static::SmartphoneType>(std::move(name));
+    }
+
+    std::unique_ptr<BasicPhone> createUniqueBasicPhone(PhoneName name) override {
+        return makeUnique<typename Static::BasicPhoneType>(std::move(name));
+    }
+
+    PhoneHandle<Smartphone> createSmartphoneHandle(PhoneName name) override {
+        return makeHandle<typename Static::SmartphoneType>(std::move(name));
+    }
+
+    PhoneHandle<BasicPhone> createBasicPhoneHandle(PhoneName name) override {
+        return makeHandle<typename Static::BasicPhoneType>(std::move(name));
+    }
+
+    LazyPhone createLazySmartphone(std::string_view name) override {
+        return LazyPhone(Brand::Id, PhoneKind::Smartphone, PhoneName::Interned(name));
+    }
+
+    LazyPhone createLazyBasicPhone(std::string_view name) override {
+        return LazyPhone(Brand::Id, PhoneKind::BasicPhone, PhoneName::Interned(name));
+    }
+};
+
+// Конкретная фабрика NokiaFactory, наследующаяся от PhoneFactory
+class NokiaFactory : public BrandPhoneFactory<NokiaBrand> {
+};
+
+// Конкретная фабрика SamsungFactory, наследующаяся от PhoneFactory
+class SamsungFactory : public BrandPhoneFactory<SamsungBrand> {
+};
+
+// Конкретная фабрика HTCFactory, наследующаяся от PhoneFactory
+class HTCFactory : public BrandPhoneFactory<HTCBrand> {
+};
+
+// Глобальный реестр фабрик: номер производителя -> заранее созданная фабрика-одиночка.
+// Поиск - одно чтение атомарного указателя из массива, без блокировок и выделений памяти.
+// Регистрация (обычно при статической инициализации через REGISTER_PHONE_FACTORY) идёт под мьютексом
+class PhoneFactoryRegistry {
+public:
+    static const std::size_t MaxBrands = 256;
+
+    static PhoneFactoryRegistry& instance() {
+        static PhoneFactoryRegistry registry;
+        return registry;
+    }
+
+    // false, если номер вне диапазона или уже занят
+    bool add(BrandId id, std::string_view name, PhoneFactory& factory) {
+        if (id >= MaxBrands)
+            return false;
+        std::lock_guard<std::mutex> lock(writeMutex);
+        Slot& slot = slots[id];
+        if (slot.factory.load(std::memory_order_relaxed))
+            return false;
+        slot.name = name; // публикуется вместе с указателем через release-запись
+        slot.factory.store(&factory, std::memory_order_release);
+        return true;
+    }
+
+    PhoneFactory* find(BrandId id) const noexcept {
+        return id < MaxBrands ? slots[id].factory.load(std::memory_order_acquire) : nullptr;
+    }
+
+    PhoneFactory& get(BrandId id) const {
+        if (PhoneFactory* factory = find(id))
+            return *factory;
+        throw std::out_of_range("PhoneFactoryRegistry: unknown brand id " + std::to_string(id));
+    }
+
+    std::string_view name(BrandId id) const noexcept {
+        return find(id) ? slots[id].name : std::string_view();
+    }
+
+    // Обходит зарегистрированные фабрики по возрастанию номера: f(id, name, factory)
+    template <class F>
+    void forEach(F f) const {
+        for (std::size_t id = 0; id < MaxBrands; ++id)
+            if (PhoneFactory* factory = slots[id].factory.load(std::memory_order_acquire))
+                f(static_cast<BrandId>(id), slots[id].name, *factory);
+    }
+
+private:
+    PhoneFactoryRegistry() {}
+
+    struct Slot {
+        std::atomic<PhoneFactory*> factory{ nullptr };
+        std::string_view name;
+    };
+
+    std::array<Slot, MaxBrands> slots;
+    std::mutex writeMutex;
+};
+
+// Фабрика-одиночка заданного типа
+template <class Factory>
+Factory& PhoneFactorySingleton() {
+    static Factory factory;
+    return factory;
+}
+
+#define CP_PHONE_CONCAT2(a, b) a##b
+#define CP_PHONE_CONCAT(a, b) CP_PHONE_CONCAT2(a, b)
+// Регистрирует фабрику-одиночку Factory под номером и названием описания производителя Brand
+#define REGISTER_PHONE_FACTORY(Factory, Brand)                                                                \
+    static const bool CP_PHONE_CONCAT(phoneFactoryRegistered_, __LINE__) =                                     \
+        PhoneFactoryRegistry::instance().add(Brand::Id, Brand::Name, PhoneFactorySingleton<Factory>())
+
+REGISTER_PHONE_FACTORY(NokiaFactory, NokiaBrand);
+REGISTER_PHONE_FACTORY(SamsungFactory, SamsungBrand);
+REGISTER_PHONE_FACTORY(HTCFactory, HTCBrand);
+
+inline std::string_view LazyPhone::manufacturer() const {
+    return PhoneFactoryRegistry::instance().name(brandId);
+}
+
+inline std::unique_ptr<Phone> PhoneDescriptor::materialize() const {
+    PhoneFactory& factory = PhoneFactoryRegistry::instance().get(brand);
+    if (kind == PhoneKind::Smartphone)
+        return factory.createUniqueSmartphone(name());
+    return factory.createUniqueBasicPhone(name());
+}
+
+// Каталог стандартных продуктов нескольких производителей, собранный при компиляции
+template <class... Brands>
+constexpr std::array<PhoneDescriptor, 2 * sizeof...(Brands)> StaticBrandCatalog() {
+    std::array<PhoneDescriptor, 2 * sizeof...(Brands)> result = {};
+    std::size_t i = 0;
+    for (const std::array<PhoneDescriptor, 2>& part : { StaticPhoneFactory<Brands>::catalog()... })
+        for (const PhoneDescriptor& d : part)
+            result[i++] = d;
+    return result;
+}
+
+// Стандартные продукты известных при компиляции производителей в порядке их номеров в реестре.
+// Набор фиксирован: производители, добавленные через REGISTER_PHONE_FACTORY, сюда не попадают
+inline constexpr std::array<PhoneDescriptor, 6> DefaultPhoneCatalog = StaticBrandCatalog<NokiaBrand, SamsungBrand, HTCBrand>();
+static_assert(DefaultPhoneCatalog[5].name() == "HTC Basic Phone", "catalog must be built at compile time");
+
+inline std::unique_ptr<Phone> LazyPhone::materialize() const {
+    PhoneFactory& factory = PhoneFactoryRegistry::instance().get(brandId);
+    if (productKind == PhoneKind::Smartphone)
+        return factory.createUniqueSmartphone(name);
+    return factory.createUniqueBasicPhone(name);
+}
+
+// Заявка на часть каталога: продукты одного вида одного производителя по списку имён.
+// Строки имён должны жить до конца построения каталога
+struct CatalogRequest {
+    BrandId brand;
+    PhoneKind kind;
+    NameSpan names;
+};
+
+// Каталог продуктов многих производителей. Порядок не зависит от числа потоков и планирования:
+// по заявкам, внутри заявки - по именам. Продукты лежат пачками ProductBatch, по пачке на кусок заявки
+class PhoneCatalog {
+public:
+    static const std::size_t DefaultChunk = 4096;
+
+    struct Part {
+        BrandId brand = 0;
+        PhoneKind kind = PhoneKind::Smartphone;
+        ProductBatch<Smartphone> smartphones;
+        ProductBatch<BasicPhone> basicPhones;
+
+        std::size_t size() const { return kind == PhoneKind::Smartphone ? smartphones.size() : basicPhones.size(); }
+        const Phone& operator[](std::size_t i) const {
+            if (kind == PhoneKind::Smartphone)
+                return smartphones[i];
+            return basicPhones[i];
+        }
+    };
+
+    // Строит каталог на пуле: заявки режутся на куски по chunk имён, каждый кусок - задача пула,
+    // которая одним пакетным вызовом фабрики заполняет свою ячейку результата. Общих буферов
+    // у задач нет, слияние - ячейки по порядку. std::out_of_range, если производитель не зарегистрирован
+    static PhoneCatalog Build(WorkStealingPool& pool, const std::vector<CatalogRequest>& requests,
+                              std::size_t chunk = DefaultChunk) {
+        chunk = std::max<std::size_t>(chunk, 1);
+        struct Task {
+            PhoneFactory* factory;
+            PhoneKind kind;
+            NameSpan names;
+        };
+        std::vector<Task> tasks;
+        PhoneCatalog catalog;
+        for (const CatalogRequest& r : requests) {
+            PhoneFactory& factory = PhoneFactoryRegistry::instance().get(r.brand);
+            for (std::size_t first = 0; first < r.names.size(); first += chunk) {
+                const std::size_t n = std::min(chunk, r.names.size() - first);
+                tasks.push_back(Task{ &factory, r.kind, NameSpan(r.names.data() + first, n) });
+                Part part;
+                part.brand = r.brand;
+                part.kind = r.kind;
+                catalog.chunks.push_back(std::move(part));
+            }
+            catalog.total += r.names.size();
+        }
+        pool.run(tasks.size(), [&tasks, &catalog](std::size_t i) {
+            const Task& t = tasks[i];
+            Part& part = catalog.chunks[i];
+            if (t.kind == PhoneKind::Smartphone)
+                part.smartphones = t.factory->createSmartphones(t.names);
+            else
+                part.basicPhones = t.factory->createBasicPhones(t.names);
+        });
+        return catalog;
+    }
+
+    // Заявки на оба вида продуктов для каждого зарегистрированного производителя, по номеру производителя
+    static std::vector<CatalogRequest> ForAllBrands(NameSpan smartphoneNames, NameSpan basicPhoneNames) {
+        std::vector<CatalogRequest> requests;
+        PhoneFactoryRegistry::instance().forEach([&](BrandId id, std::string_view, PhoneFactory&) {
+            requests.push_back(CatalogRequest{ id, PhoneKind::Smartphone, smartphoneNames });
+            requests.push_back(CatalogRequest{ id, PhoneKind::BasicPhone, basicPhoneNames });
+        });
+        return requests;
+    }
+
+    std::size_t size() const { return total; }
+    bool empty() const { return total == 0; }
+    const std::vector<Part>& parts() const { return chunks; }
+
+    // Обходит продукты по порядку каталога: f(brand, kind, phone)
+    template <class F>
+    void forEach(F f) const {
+        for (const Part& part : chunks)
+            for (std::size_t i = 0; i < part.size(); ++i)
+                f(part.brand, part.kind, part[i]);
+    }
+
+private:
+    std::vector<Part> chunks;
+    std::size_t total = 0;
+};
+
+// Отчёт о производителях из реестра: по три строки на фабрику. Строки собираются из кусков
+// и передаются писателю одним WriteV(), без форматирования потоков C++
+inline void WriteManufacturerReport(OutputWriter& out) {
+    std::string man;
+    PhoneFactoryRegistry::instance().forEach([&man, &out](BrandId, std::string_view brand, PhoneFactory& factory) {
+        man.assign(brand.data(), brand.size());
+        std::unique_ptr<Smartphone> smartphone = factory.createUniqueSmartphone(man + " Smartphone");
+        std::unique_ptr<BasicPhone> basicPhone = factory.createUniqueBasicPhone(man + " Basic Phone");
+
+        const std::string_view parts[] = { "Manufacturer: ", man, "\nSmarphone: ", smartphone->getName(),
+                                           "\nBasic phone: ", basicPhone->getName(), "\n" };
+        out.WriteV(parts, sizeof(parts) / sizeof(parts[0]));
+    });
+}
+
+// Отчёт в том же виде, что WriteManufacturerReport(), но по описаниям продуктов:
+// без фабрик, объектов продуктов и выделений памяти. Производитель печатается при смене бренда
+inline void WriteCatalogReport(OutputWriter& out, const PhoneDescriptor* first, std::size_t count) {
+    for (std::size_t i = 0; i < count; ++i) {
+        const PhoneDescriptor& d = first[i];
+        if (i == 0 || first[i - 1].brand != d.brand) {
+            const std::string_view header[] = { "Manufacturer: ", d.manufacturer, "\n" };
+            out.WriteV(header, 3);
+        }
+        const std::string_view line[] = { d.kind == PhoneKind::Smartphone ? "Smarphone: " : "Basic phone: ", d.name(), "\n" };
+        out.WriteV(line, 3);
+    }
+}
+
+template <std::size_t N>
+void WriteCatalogReport(OutputWriter& out, const std::array<PhoneDescriptor, N>& catalog) {
+    WriteCatalogReport(out, catalog.data(), N);
+}
+
+#ifdef CP_TRPO_BENCH
+// Набор микробенчмарков горячих путей в духе Google Benchmark.
+// Сборка: g++ -std=c++17 -O2 -pthread -DCP_TRPO_BENCH main.cpp -o bench
+// Запуск: ./bench [подстрока имени] - выполняются только бенчмарки, в имени которых есть подстрока;
+// ./bench --footprint - отчёт о расходе памяти на объект и на элемент контейнера для каждого типа
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Счётчик выделений памяти: в бенчмарк-сборке глобальный operator new заменён на считающий.
+// noinline у замен: иначе GCC после встраивания предупреждает о несовпадении malloc / operator delete
+static std::atomic<std::uint64_t> benchAllocations(0);
+static std::atomic<std::uint64_t> benchAllocatedBytes(0);
+
+// Занятая память кучи вместе с накладными расходами распределителя (заголовок и округление блока malloc).
+// Считается только в режиме --footprint и только там, где размер блока можно узнать (glibc)
+static std::atomic<bool> benchTrackHeap(false);
+static std::atomic<std::int64_t> benchHeapBytes(0);
+
+#if defined(__GLIBC__)
+static const bool BenchHeapKnown = true;
+#else
+static const bool BenchHeapKnown = false;
+#endif
+
+static std::int64_t HeapChunkBytes(void* p) {
+#if defined(__GLIBC__)
+    return static_cast<std::int64_t>(malloc_usable_size(p) + sizeof(std::size_t));
+#else
+    (void)p;
+    return 0;
+#endif
+}
+
+__attribute__((noinline)) void* operator new(std::size_t n) {
+    benchAllocations.fetch_add(1, std::memory_order_relaxed);
+    benchAllocatedBytes.fetch_add(n, std::memory_order_relaxed);
+    if (void* p = std::malloc(n ? n : 1)) {
+        if (benchTrackHeap.load(std::memory_order_relaxed))
+            benchHeapBytes.fetch_add(HeapChunkBytes(p), std::memory_order_relaxed);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    if (p && benchTrackHeap.load(std::memory_order_relaxed))
+        benchHeapBytes.fetch_sub(HeapChunkBytes(p), std::memory_order_relaxed);
+    std::free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept { operator delete(p); }
+
+// Аппаратный счётчик промахов кэша (perf_event на Linux). Если счётчик недоступен, valid() == false
+class CacheMissCounter {
+public:
+    CacheMissCounter() {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    ~CacheMissCounter() {
+#if defined(__linux__)
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    bool valid() const { return fd >= 0; }
+
+    void start() {
+#if defined(__linux__)
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    std::uint64_t stop() {
+        std::uint64_t value = 0;
+#if defined(__linux__)
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value)))
+                value = 0;
+        }
+#endif
+        return value;
+    }
+
+private:
+    int fd = -1;
+};
+
+// Состояние одного запуска: тело бенчмарка выполняется в цикле for (auto _ : state),
+// замер идёт только внутри цикла, подготовка до него не учитывается
+class BenchState {
+public:
+    BenchState(std::vector<std::int64_t> a, std::uint64_t n, CacheMissCounter& c) : args(std::move(a)), iters(n), misses(c) {}
+
+    std::int64_t range(std::size_t i) const { return args[i]; }
+    std::uint64_t iterations() const { return iters; }
+
+    // Число обработанных элементов: тогда время и выделения считаются на элемент, а не на итерацию
+    void SetItemsProcessed(std::uint64_t n) { items = n; }
+    // Текст, выводимый в конце строки результата
+    void SetLabel(std::string text) { label = std::move(text); }
+
+    // Значение переменной цикла; нетривиальный деструктор убирает предупреждение о неиспользуемой переменной
+    struct Value {
+        ~Value() {}
+    };
+
+    struct Iterator {
+        BenchState* state;
+        std::uint64_t left;
+        bool operator!=(const Iterator&) {
+            if (left != 0)
+                return true;
+            state->finish();
+            return false;
+        }
+        void operator++() { --left; }
+        Value operator*() const { return Value(); }
+    };
+
+    Iterator begin() {
+        allocsAtStart = benchAllocations.load(std::memory_order_relaxed);
+        bytesAtStart = benchAllocatedBytes.load(std::memory_order_relaxed);
+        misses.start();
+        startTime = std::chrono::steady_clock::now();
+        return Iterator{ this, iters };
+    }
+    Iterator end() { return Iterator{ this, 0 }; }
+
+    double seconds = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t bytes = 0; // запрошено у operator new
+    std::uint64_t cacheMisses = 0;
+    std::uint64_t items = 0;
+    std::string label;
+
+private:
+    void finish() {
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        cacheMisses = misses.stop();
+        allocations = benchAllocations.load(std::memory_order_relaxed) - allocsAtStart;
+        bytes = benchAllocatedBytes.load(std::memory_order_relaxed) - bytesAtStart;
+    }
+
+    std::vector<std::int64_t> args;
+    std::uint64_t iters;
+    CacheMissCounter& misses;
+    std::chrono::steady_clock::time_point startTime;
+    std::uint64_t allocsAtStart = 0;
+    std::uint64_t bytesAtStart = 0;
+};
+
+struct BenchCase {
+    std::string name;
+    void (*fn)(BenchState&);
+    std::vector<std::vector<std::int64_t>> argSets;
+};
+
+static std::vector<BenchCase>& BenchRegistry() {
+    static std::vector<BenchCase> cases;
+    return cases;
+}
+
+struct BenchRegistrar {
+    BenchRegistrar(const char* name, void (*fn)(BenchState&), std::vector<std::vector<std::int64_t>> argSets) {
+        if (argSets.empty())
+            argSets.emplace_back();
+        BenchRegistry().push_back(BenchCase{ name, fn, std::move(argSets) });
+    }
+};
+
+#define CP_BENCH_CONCAT2(a, b) a##b
+#define CP_BENCH_CONCAT(a, b) CP_BENCH_CONCAT2(a, b)
+// CP_BENCHMARK(функция, {{аргументы}, ...}) регистрирует бенчмарк с наборами аргументов
+#define CP_BENCHMARK(fn, ...) static BenchRegistrar CP_BENCH_CONCAT(benchReg_, __LINE__)(#fn, fn, __VA_ARGS__)
+
+// Не даёт компилятору выбросить вычисление значения
+template <class T>
+inline void DoNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Поток, отбрасывающий вывод: в замер входит кодирование команд, но не запись на устройство
+class NullStreamBuf : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+static std::ostream& NullStream() {
+    static NullStreamBuf buf;
+    static std::ostream os(&buf);
+    return os;
+}
+
+// Сцена для бенчмарков рисования. Хранится только последняя, чтобы сцены по 10M фигур не копились в памяти
+static DrwManager& BenchScene(StorageMode mode, std::size_t n) {
+    static std::unique_ptr<DrwManager> scene;
+    static StorageMode sceneMode;
+    static std::size_t sceneSize = 0;
+    if (!scene || sceneMode != mode || sceneSize != n) {
+        scene.reset();
+        scene.reset(new DrwManager(mode));
+        scene->clear();
+        for (std::size_t i = 0; i < n; ++i) {
+            const Point p(static_cast<int>(i % 1000), static_cast<int>(i / 1000));
+            if (i % 2)
+                scene->addCircle(p, 3);
+            else
+                scene->addSquare(p, 3);
+        }
+        sceneMode = mode;
+        sceneSize = n;
+    }
+    return *scene;
+}
+
+static void BM_MakeSharedCircle(BenchState& state) {
+    for (auto _ : state) {
+        std::shared_ptr<Shape> shape = std::make_shared<Circle>(Point(1, 2), 3);
+        DoNotOptimize(shape);
+    }
+}
+CP_BENCHMARK(BM_MakeSharedCircle, {});
+
+static void BM_MakeSharedSquare(BenchState& state) {
+    for (auto _ : state) {
+        std::shared_ptr<Shape> shape = std::make_shared<Square>(Point(1, 2), 3);
+        DoNotOptimize(shape);
+    }
+}
+CP_BENCHMARK(BM_MakeSharedSquare, {});
+
+// Полный кадр drawShapes() в текстовый приёмник с отброшенным выводом; аргументы: режим хранения, число фигур
+static void BM_DrawShapes(BenchState& state) {
+    const StorageMode mode = static_cast<StorageMode>(state.range(0));
+    const std::size_t n = static_cast<std::size_t>(state.range(1));
+    DrwManager& scene = BenchScene(mode, n);
+    TextRenderSink sink(NullStream());
+    scene.drawShapes(sink); // прогрев: буферы приёмника достигают размера кадра
+    for (auto _ : state)
+        scene.drawShapes(sink);
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+static std::vector<std::vector<std::int64_t>> DrawShapesArgs() {
+    std::vector<std::vector<std::int64_t>> args;
+    for (StorageMode mode : { StorageMode::List, StorageMode::Arena, StorageMode::Variant, StorageMode::Packed })
+        for (std::int64_t n : { 1000, 10000, 100000, 1000000, 10000000 })
+            args.push_back({ static_cast<std::int64_t>(mode), n });
+    return args;
+}
+CP_BENCHMARK(BM_DrawShapes, DrawShapesArgs());
+
+// Только запись команд в буфер, без кодирования: сравнение виртуального вызова, std::visit и SoA
+static void BM_RecordShapes(BenchState& state) {
+    const std::size_t n = static_cast<std::size_t>(state.range(1));
+    DrwManager& scene = BenchScene(static_cast<StorageMode>(state.range(0)), n);
+    CommandBuffer buf;
+    buf.Reserve(n);
+    for (auto _ : state) {
+        buf.Clear();
+        scene.recordShapes(buf);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_RecordShapes, DrawShapesArgs());
+
+// Загрузка сцены из файла и первый кадр: Mapped рисует прямо из отображённого файла,
+// остальные режимы сначала переносят записи в своё хранилище. Аргументы: режим хранения, число фигур
+static void BM_LoadScene(BenchState& state) {
+    const StorageMode mode = static_cast<StorageMode>(state.range(0));
+    const std::size_t n = static_cast<std::size_t>(state.range(1));
+    const std::string path = "cp_trpo_bench_scene.bin";
+    BenchScene(StorageMode::Variant, n).saveScene(path);
+    TextRenderSink sink(NullStream());
+    for (auto _ : state) {
+        DrwManager scene(mode);
+        scene.loadScene(path);
+        scene.drawShapes(sink);
+    }
+    std::remove(path.c_str());
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+static std::vector<std::vector<std::int64_t>> LoadSceneArgs() {
+    std::vector<std::vector<std::int64_t>> args;
+    for (StorageMode mode : { StorageMode::List, StorageMode::Packed, StorageMode::Mapped })
+        for (std::int64_t n : { 10000, 1000000 })
+            args.push_back({ static_cast<std::int64_t>(mode), n });
+    return args;
+}
+CP_BENCHMARK(BM_LoadScene, LoadSceneArgs());
+
+#if defined(CP_TRPO_HAS_WRITEV)
+// Текстовый кадр сцены 1M фигур в файл: 0 - std::ofstream, 1 - FdWriter, 2 - BufferedWriter над FdWriter
+static void BM_DrawToFile(BenchState& state) {
+    const std::int64_t how = state.range(0);
+    const std::size_t n = 1000000;
+    const std::string path = "cp_trpo_bench_out.txt";
+    DrwManager& scene = BenchScene(StorageMode::Packed, n);
+    {
+        std::ofstream file(path, std::ios::binary);
+        FdWriter fd;
+        fd.open(path + ".fd");
+        BufferedWriter buffered(fd);
+        std::unique_ptr<RenderSink> sink;
+        if (how == 0)
+            sink.reset(new TextRenderSink(file));
+        else if (how == 1)
+            sink.reset(new TextRenderSink(fd));
+        else
+            sink.reset(new TextRenderSink(buffered));
+        for (auto _ : state)
+            scene.drawShapes(*sink);
+        buffered.Flush();
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".fd").c_str());
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_DrawToFile, { { 0 }, { 1 }, { 2 } });
+
+// Отчёт о производителях в файл, на строку: 0 - прежний вывод operator<< в std::ofstream,
+// 1 - WriteManufacturerReport() через BufferedWriter над FdWriter
+static void BM_ManufacturerReportToFile(BenchState& state) {
+    const bool writer = state.range(0) != 0;
+    const std::string path = "cp_trpo_bench_report.txt";
+    {
+        std::ofstream file(path, std::ios::binary);
+        FdWriter fd;
+        fd.open(path + ".fd");
+        BufferedWriter out(fd);
+        std::string man;
+        for (auto _ : state) {
+            if (writer) {
+                WriteManufacturerReport(out);
+                continue;
+            }
+            PhoneFactoryRegistry::instance().forEach([&man, &file](BrandId, std::string_view brand, PhoneFactory& factory) {
+                man.assign(brand.data(), brand.size());
+                std::unique_ptr<Smartphone> smartphone = factory.createUniqueSmartphone(man + " Smartphone");
+                std::unique_ptr<BasicPhone> basicPhone = factory.createUniqueBasicPhone(man + " Basic Phone");
+                file << "Manufacturer: " << man << "\n";
+                file << "Smarphone: " << smartphone->getName() << "\n";
+                file << "Basic phone: " << basicPhone->getName() << "\n";
+            });
+        }
+        out.Flush();
+    }
+    std::remove(path.c_str());
+    std::remove((path + ".fd").c_str());
+    state.SetItemsProcessed(state.iterations() * 9);
+}
+CP_BENCHMARK(BM_ManufacturerReportToFile, { { 0 }, { 1 } });
+#endif
+
+// Дельта сцены 1M фигур после перемещения 100 фигур: сборка, кодирование и применение у зрителя.
+// Время на изменение не зависит от размера сцены
+static void BM_SceneDelta(BenchState& state) {
+    const std::size_t n = 1000000;
+    const std::size_t moved = 100;
+    DrwManager scene(StorageMode::Packed);
+    scene.clear();
+    std::vector<ShapeHandle> handles;
+    for (std::size_t i = 0; i < n; ++i)
+        handles.push_back(scene.addCircle(Point(static_cast<int>(i % 1000), static_cast<int>(i / 1000)), 3));
+    scene.enableDeltaTracking();
+    SceneReplica replica;
+    std::string wire;
+    scene.takeDelta().encode(wire);
+    replica.apply(wire.data(), wire.size());
+    std::size_t k = 0;
+    for (auto _ : state) {
+        for (std::size_t i = 0; i < moved; ++i, ++k)
+            scene.setCenter(handles[(k * 7919) % n], Point(static_cast<int>(k % 1000), 0));
+        wire.clear();
+        scene.takeDelta().encode(wire);
+        replica.apply(wire.data(), wire.size());
+    }
+    DoNotOptimize(replica);
+    state.SetItemsProcessed(state.iterations() * moved);
+}
+CP_BENCHMARK(BM_SceneDelta, {});
+
+// Сцена из 1024 фигур, заданная при компиляции
+static constexpr std::array<SceneRecord, 1024> BenchStaticScene() {
+    std::array<SceneRecord, 1024> scene = {};
+    for (std::size_t i = 0; i < scene.size(); ++i)
+        scene[i] = MakeSceneRecord(i % 2 ? ShapeType::Square : ShapeType::Circle,
+                                   Point(static_cast<int>(i % 32), static_cast<int>(i / 32)), 3);
+    return scene;
+}
+static constexpr std::array<SceneRecord, 1024> StaticSceneRecords = BenchStaticScene();
+
+// Загрузка и кадр статической сцены: 0 - перенос в плотное хранилище (Packed), 1 - прямо из массива (Mapped)
+static void BM_LoadStaticScene(BenchState& state) {
+    const bool mapped = state.range(0) != 0;
+    DrwManager scene(mapped ? StorageMode::Mapped : StorageMode::Packed);
+    TextRenderSink sink(NullStream());
+    scene.loadStaticScene(StaticSceneRecords);
+    scene.drawShapes(sink); // прогрев буферов приёмника
+    for (auto _ : state) {
+        scene.loadStaticScene(StaticSceneRecords);
+        scene.drawShapes(sink);
+    }
+    state.SetItemsProcessed(state.iterations() * StaticSceneRecords.size());
+}
+CP_BENCHMARK(BM_LoadStaticScene, { { 0 }, { 1 } });
+
+// Отчёт о производителях: 0 - через фабрики реестра, 1 - из constexpr-каталога
+static void BM_CatalogReport(BenchState& state) {
+    const bool fixed = state.range(0) != 0;
+    StreamWriter out(NullStream());
+    for (auto _ : state) {
+        if (fixed)
+            WriteCatalogReport(out, DefaultPhoneCatalog);
+        else
+            WriteManufacturerReport(out);
+    }
+}
+CP_BENCHMARK(BM_CatalogReport, { { 0 }, { 1 } });
+
+// Потоковое рисование 1M записей из памяти кусками заданного размера; аргумент - размер куска
+static void BM_DrawStream(BenchState& state) {
+    const std::size_t chunk = static_cast<std::size_t>(state.range(0));
+    const std::size_t n = 1000000;
+    const std::string path = "cp_trpo_bench_stream.bin";
+    BenchScene(StorageMode::Variant, n).saveScene(path);
+    std::ifstream file(path, std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    std::remove(path.c_str());
+    DrwManager scene(StorageMode::Mapped);
+    TextRenderSink sink(NullStream());
+    for (auto _ : state) {
+        std::istringstream in(data);
+        scene.drawStream(in, sink, chunk);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_DrawStream, { { 1024 }, { 65536 } });
+
+// Рисование с уровнем детализации, 1M фигур (шаг сетки 1, размер 3); аргументы: режим хранения, масштаб в тысячных
+static void BM_DrawShapesLod(BenchState& state) {
+    const std::size_t n = 1000000;
+    DrwManager& scene = BenchScene(static_cast<StorageMode>(state.range(0)), n);
+    const double scale = static_cast<double>(state.range(1)) / 1000.0;
+    TextRenderSink sink(NullStream());
+    scene.drawShapes(scale, sink);
+    for (auto _ : state)
+        scene.drawShapes(scale, sink);
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_DrawShapesLod, { { 1, 1000 }, { 1, 100 }, { 1, 10 }, { 0, 1000 }, { 0, 10 } });
+
+// Кадр 1M фигур в двоичный приёмник: 0 - отдельные команды drawShapes(), 1 - группы подряд идущих,
+// 2 - группы по (тип, размер)
+static void BM_DrawInstanced(BenchState& state) {
+    const std::size_t n = 1000000;
+    DrwManager& scene = BenchScene(StorageMode::Packed, n);
+    BinaryRenderSink sink(NullStream());
+    const std::int64_t how = state.range(0);
+    auto frame = [&] {
+        if (how == 0)
+            scene.drawShapes(sink);
+        else
+            scene.drawInstanced(sink, how == 2);
+    };
+    frame();
+    for (auto _ : state)
+        frame();
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_DrawInstanced, { { 0 }, { 1 }, { 2 } });
+
+// Кадр 100K фигур текстом: 0 - drawShapes() на вызывающем потоке, 1 - drawShapesAsync() через конвейер,
+// кодирование и вывод идут в фоновом потоке параллельно записи следующего кадра
+static void BM_DrawShapesAsync(BenchState& state) {
+    const std::size_t n = 100000;
+    DrwManager& scene = BenchScene(StorageMode::Packed, n);
+    TextRenderSink sink(NullStream());
+    if (state.range(0) == 0) {
+        scene.drawShapes(sink);
+        for (auto _ : state)
+            scene.drawShapes(sink);
+    }
+    else {
+        FramePipeline pipeline(sink);
+        scene.drawShapesAsync(pipeline).wait();
+        for (auto _ : state)
+            scene.drawShapesAsync(pipeline);
+        pipeline.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_DrawShapesAsync, { { 0 }, { 1 } });
+
+// Замена фигур в плотном хранилище 100K фигур: удаление по устойчивой ссылке и добавление новой
+static void BM_PackedChurn(BenchState& state) {
+    const std::size_t n = 100000;
+    DrwManager scene(StorageMode::Packed);
+    scene.clear();
+    std::vector<ShapeHandle> handles;
+    for (std::size_t i = 0; i < n; ++i)
+        handles.push_back(scene.addCircle(Point(static_cast<int>(i % 1000), static_cast<int>(i / 1000)), 3));
+    std::size_t k = 0;
+    for (auto _ : state) {
+        const std::size_t i = (k * 7919) % n;
+        scene.removeShape(handles[i]);
+        handles[i] = scene.addSquare(Point(static_cast<int>(k % 1000), 0), 2);
+        ++k;
+    }
+}
+CP_BENCHMARK(BM_PackedChurn, {});
+
+static void BM_GetType(BenchState& state) {
+    const Circle circle(Point(0, 0), 1);
+    const Square square(Point(0, 0), 1);
+    const Shape* shapes[2] = { &circle, &square };
+    std::size_t i = 0;
+    for (auto _ : state) {
+        std::string_view type = shapes[i++ & 1]->GetType();
+        DoNotOptimize(type);
+    }
+}
+CP_BENCHMARK(BM_GetType, {});
+
+// Аргументы: производитель (0 - Nokia, 1 - Samsung, 2 - HTC), пул продуктов (0 / 1), интернирование имён (0 / 1)
+static void BM_CreateSmartphone(BenchState& state) {
+    std::unique_ptr<PhoneFactory> factory;
+    switch (state.range(0)) {
+    case 0:
+        factory.reset(new NokiaFactory());
+        break;
+    case 1:
+        factory.reset(new SamsungFactory());
+        break;
+    default:
+        factory.reset(new HTCFactory());
+    }
+    factory->setPooling(state.range(1) != 0);
+    factory->setNameInterning(state.range(2) != 0);
+    for (auto _ : state) {
+        std::shared_ptr<Smartphone> phone = factory->createSmartphone("Catalog Smartphone Model");
+        DoNotOptimize(phone);
+    }
+}
+CP_BENCHMARK(BM_CreateSmartphone, { { 0, 0, 0 }, { 1, 0, 0 }, { 2, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 }, { 0, 1, 1 } });
+
+// Фабрика времени компиляции: ни объекта фабрики, ни виртуальных вызовов, ни shared_ptr
+static void BM_StaticCreateSmartphone(BenchState& state) {
+    for (auto _ : state) {
+        NokiaSmartphone phone = StaticPhoneFactory<NokiaBrand>::createSmartphone(PhoneName::Unowned("Catalog Smartphone Model"));
+        std::string_view name = phone.getName();
+        DoNotOptimize(name);
+    }
+}
+CP_BENCHMARK(BM_StaticCreateSmartphone, {});
+
+// Выбор фабрики по номеру производителя из реестра и создание продукта
+static void BM_RegistryCreateSmartphone(BenchState& state) {
+    const PhoneFactoryRegistry& registry = PhoneFactoryRegistry::instance();
+    BrandId id = 0;
+    for (auto _ : state) {
+        std::shared_ptr<Smartphone> phone = registry.get(id).createSmartphone("Catalog Smartphone Model");
+        DoNotOptimize(phone);
+        id = static_cast<BrandId>((id + 1) % 3);
+    }
+}
+CP_BENCHMARK(BM_RegistryCreateSmartphone, {});
+
+// Нагрузка из нескольких потоков на одну общую фабрику. Аргументы: число потоков,
+// способ создания (0 - make_shared, 1 - общий пул, 2 - LocalProduct из кэша потока).
+// Время - на один продукт по всем потокам: при линейном масштабировании падает обратно числу потоков.
+// Имя короче PhoneName::InlineCapacity: длинное имя ушло бы в operator new, а его общие счётчики
+// benchAllocations/benchAllocatedBytes - те самые межпоточные атомики, которых здесь быть не должно.
+// В конце строки - пропускная способность, ускорение к одному потоку того же способа и число ядер машины:
+// по ним проверяется масштабирование на многоядерной машине
+static void BM_ConcurrentCreateSmartphone(BenchState& state) {
+    const unsigned threads = static_cast<unsigned>(state.range(0));
+    const std::int64_t how = state.range(1);
+    const std::size_t perTask = 10000;
+    const char* name = "Catalog Model";
+    NokiaFactory factory;
+    factory.setPooling(how == 1);
+    WorkStealingPool pool(threads);
+    const std::function<void(std::size_t)> task = [&](std::size_t) {
+        for (std::size_t i = 0; i < perTask; ++i) {
+            if (how == 2) {
+                LocalProduct<Smartphone> phone = factory.createLocalSmartphone(name);
+                DoNotOptimize(phone);
+            }
+            else {
+                std::shared_ptr<Smartphone> phone = factory.createSmartphone(name);
+                DoNotOptimize(phone);
+            }
+        }
+    };
+    pool.run(threads, task); // прогрев: потоки запущены, кэши и пул заполнены
+    for (auto _ : state)
+        pool.run(threads, task);
+    state.SetItemsProcessed(state.iterations() * threads * perTask);
+
+    // Ускорение считается к замеру одного потока того же способа (наборы аргументов идут от 1 потока вверх);
+    // без него, например при фильтре по имени, выводится только пропускная способность
+    static double singleThreadRate[3] = {};
+    const double rate = static_cast<double>(state.iterations() * threads * perTask) / state.seconds;
+    if (threads == 1)
+        singleThreadRate[how] = rate;
+    char text[128];
+    if (singleThreadRate[how] > 0)
+        std::snprintf(text, sizeof(text), "%.2f M/s, x%.2f vs 1 thread, %u cores", rate / 1e6,
+                      rate / singleThreadRate[how], std::thread::hardware_concurrency());
+    else
+        std::snprintf(text, sizeof(text), "%.2f M/s, %u cores", rate / 1e6, std::thread::hardware_concurrency());
+    state.SetLabel(text);
+}
+
+static std::vector<std::vector<std::int64_t>> ConcurrentCreateArgs() {
+    std::vector<std::vector<std::int64_t>> args;
+    for (std::int64_t how : { 0, 1, 2 })
+        for (std::int64_t threads : { 1, 2, 4, 8, 16, 32 })
+            args.push_back({ threads, how });
+    return args;
+}
+CP_BENCHMARK(BM_ConcurrentCreateSmartphone, ConcurrentCreateArgs());
+
+// Каталог 3 производителя x 2 вида x 100K имён на пуле; аргумент - число потоков
+static void BM_BuildCatalog(BenchState& state) {
+    const unsigned threads = static_cast<unsigned>(state.range(0));
+    std::vector<std::string> storage;
+    for (std::size_t i = 0; i < 100000; ++i)
+        storage.push_back("Catalog Model " + std::to_string(i));
+    const std::vector<std::string_view> names(storage.begin(), storage.end());
+    const std::vector<CatalogRequest> requests = PhoneCatalog::ForAllBrands(names, names);
+    WorkStealingPool pool(threads);
+    std::size_t total = 0;
+    for (auto _ : state) {
+        PhoneCatalog catalog = PhoneCatalog::Build(pool, requests);
+        total += catalog.size();
+    }
+    DoNotOptimize(total);
+    state.SetItemsProcessed(total);
+}
+CP_BENCHMARK(BM_BuildCatalog, { { 1 }, { 2 }, { 4 }, { 8 } });
+
+// Способ владения продуктом: 0 - shared_ptr, 1 - unique_ptr, 2 - PhoneHandle. Короткое имя лежит в самом PhoneName,
+// поэтому bytes/op - размер самого блока продукта со служебными данными
+static void BM_CreateOwnedSmartphone(BenchState& state) {
+    NokiaFactory factory;
+    const std::int64_t how = state.range(0);
+    for (auto _ : state) {
+        if (how == 0) {
+            std::shared_ptr<Smartphone> phone = factory.createSmartphone("Model 1");
+            DoNotOptimize(phone);
+        }
+        else if (how == 1) {
+            std::unique_ptr<Smartphone> phone = factory.createUniqueSmartphone("Model 1");
+            DoNotOptimize(phone);
+        }
+        else {
+            PhoneHandle<Smartphone> phone = factory.createSmartphoneHandle("Model 1");
+            DoNotOptimize(phone);
+        }
+    }
+}
+CP_BENCHMARK(BM_CreateOwnedSmartphone, { { 0 }, { 1 }, { 2 } });
+
+// Продукт, у которого только проверяют имя: 0 - полный объект в unique_ptr, 1 - LazyPhone
+static void BM_CreateCheckedSmartphone(BenchState& state) {
+    NokiaFactory factory;
+    const bool lazy = state.range(0) != 0;
+    std::size_t matched = 0;
+    for (auto _ : state) {
+        if (lazy) {
+            LazyPhone phone = factory.createLazySmartphone("Catalog Smartphone Model");
+            matched += phone.getName().size() > 8;
+        }
+        else {
+            std::unique_ptr<Smartphone> phone = factory.createUniqueSmartphone("Catalog Smartphone Model");
+            matched += phone->getName().size() > 8;
+        }
+    }
+    DoNotOptimize(matched);
+}
+CP_BENCHMARK(BM_CreateCheckedSmartphone, { { 0 }, { 1 } });
+
+// Копирование и разрушение копии владеющего указателя: 0 - shared_ptr (атомарный счётчик), 1 - PhoneHandle
+static void BM_CopyOwnedSmartphone(BenchState& state) {
+    NokiaFactory factory;
+    std::shared_ptr<Smartphone> shared = factory.createSmartphone("Model 1");
+    PhoneHandle<Smartphone> handle = factory.createSmartphoneHandle("Model 1");
+    const bool intrusive = state.range(0) != 0;
+    for (auto _ : state) {
+        if (intrusive) {
+            PhoneHandle<Smartphone> copy = handle;
+            DoNotOptimize(copy);
+        }
+        else {
+            std::shared_ptr<Smartphone> copy = shared;
+            DoNotOptimize(copy);
+        }
+    }
+}
+CP_BENCHMARK(BM_CopyOwnedSmartphone, { { 0 }, { 1 } });
+
+// Пакетное создание; аргумент - размер пачки
+static void BM_CreateSmartphonesBatch(BenchState& state) {
+    NokiaFactory factory;
+    const std::size_t n = static_cast<std::size_t>(state.range(0));
+    std::vector<std::string> storage;
+    for (std::size_t i = 0; i < n; ++i)
+        storage.push_back("Catalog Smartphone Model " + std::to_string(i));
+    std::vector<std::string_view> names(storage.begin(), storage.end());
+    for (auto _ : state) {
+        ProductBatch<Smartphone> batch = factory.createSmartphones(names);
+        DoNotOptimize(batch[0]);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+CP_BENCHMARK(BM_CreateSmartphonesBatch, { { 100 }, { 10000 } });
+
+// Подбирает число итераций так, чтобы замер длился не меньше minSeconds, и печатает строку отчёта
+static void RunBenchCase(const BenchCase& bench, const std::vector<std::int64_t>& args, CacheMissCounter& misses) {
+    const double minSeconds = 0.2;
+    std::string name = bench.name;
+    for (std::int64_t a : args)
+        name += "/" + std::to_string(a);
+
+    std::uint64_t iters = 1;
+    for (;;) {
+        BenchState state(args, iters, misses);
+        bench.fn(state);
+        if (state.seconds >= minSeconds || iters >= (1ull << 40)) {
+            const double per = static_cast<double>(state.items ? state.items : state.iterations());
+            char misses_text[32] = "n/a";
+            if (misses.valid())
+                std::snprintf(misses_text, sizeof(misses_text), "%.3f", state.cacheMisses / per);
+            std::printf("%-36s %14.2f %12llu %12.3f %12.1f %16s%s%s\n", name.c_str(), state.seconds * 1e9 / per,
+                        static_cast<unsigned long long>(state.iterations()), state.allocations / per, state.bytes / per,
+                        misses_text, state.label.empty() ? "" : "  ", state.label.c_str());
+            std::fflush(stdout);
+            return;
+        }
+        const double grow = state.seconds > 0 ? minSeconds * 1.4 / state.seconds : 100.0;
+        iters = static_cast<std::uint64_t>(static_cast<double>(iters) * std::min(100.0, std::max(2.0, grow)));
+    }
+}
+
+// Замер памяти, добавленной build() на n элементов: байты кучи с накладными расходами и число выделений.
+// build() возвращает владельца созданных элементов, память считается, пока он жив
+struct FootprintRow {
+    const char* name;
+    std::size_t objectBytes; // sizeof элемента в контейнере, 0 - не применимо
+    double heapBytes;        // на элемент
+    double allocs;           // на элемент
+};
+
+template <class F>
+static FootprintRow MeasureFootprint(const char* name, std::size_t objectBytes, std::size_t n, F build) {
+    const std::int64_t heapBefore = benchHeapBytes.load(std::memory_order_relaxed);
+    const std::uint64_t allocsBefore = benchAllocations.load(std::memory_order_relaxed);
+    auto owner = build(n);
+    const double heap = static_cast<double>(benchHeapBytes.load(std::memory_order_relaxed) - heapBefore);
+    const double allocs = static_cast<double>(benchAllocations.load(std::memory_order_relaxed) - allocsBefore);
+    DoNotOptimize(owner);
+    return FootprintRow{ name, objectBytes, heap / static_cast<double>(n), allocs / static_cast<double>(n) };
+}
+
+// Сцена из n фигур (поровну кругов и квадратов) в заданном режиме хранения
+static std::unique_ptr<DrwManager> FootprintScene(StorageMode mode, std::size_t n) {
+    std::unique_ptr<DrwManager> scene(new DrwManager(mode));
+    scene->clear();
+    for (std::size_t i = 0; i < n; ++i) {
+        const Point c(static_cast<int>(i % 1000), static_cast<int>(i / 1000));
+        if (i % 2)
+            scene->addSquare(c, 4);
+        else
+            scene->addCircle(c, 3);
+    }
+    return scene;
+}
+
+// n продуктов, созданных make(factory, name), в заранее зарезервированном векторе
+template <class P, class Make>
+static std::vector<P> FootprintPhones(std::size_t n, const char* name, Make make) {
+    static NokiaFactory factory;
+    std::vector<P> phones;
+    phones.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+        phones.push_back(make(factory, name));
+    return phones;
+}
+
+static void RunFootprintReport() {
+    benchTrackHeap.store(true);
+    const std::size_t shapes = 100000;
+    const std::size_t phones = 10000;
+    const char* longName = "Catalog Smartphone Model"; // длиннее InlineCapacity
+    const char* shortName = "Model 1";
+    std::vector<FootprintRow> rows = {
+        { "Point", sizeof(Point), 0, 0 },
+        { "DrawCmd", sizeof(DrawCmd), 0, 0 },
+        { "SceneRecord", sizeof(SceneRecord), 0, 0 },
+        { "Circle", sizeof(Circle), 0, 0 },
+        { "Square", sizeof(Square), 0, 0 },
+        { "ShapeValue", sizeof(ShapeValue), 0, 0 },
+        { "ShapeHandle", sizeof(ShapeHandle), 0, 0 },
+        { "PhoneName", sizeof(PhoneName), 0, 0 },
+        { "NokiaSmartphone", sizeof(NokiaSmartphone), 0, 0 },
+        { "LazyPhone", sizeof(LazyPhone), 0, 0 },
+    };
+    // Память на фигуру включает запас ёмкости контейнеров после роста
+    const std::pair<const char*, StorageMode> modes[] = {
+        { "scene List", StorageMode::List },
+        { "scene Packed", StorageMode::Packed },
+        { "scene Arena", StorageMode::Arena },
+        { "scene Variant", StorageMode::Variant },
+    };
+    for (const auto& m : modes)
+        rows.push_back(MeasureFootprint(m.first, 0, shapes, [&m](std::size_t n) { return FootprintScene(m.second, n); }));
+
+    for (const char* name : { longName, shortName }) {
+        const bool isLong = name == longName;
+        rows.push_back(MeasureFootprint(isLong ? "shared_ptr, long name" : "shared_ptr, short name",
+                                        sizeof(std::shared_ptr<Smartphone>), phones, [name](std::size_t n) {
+            return FootprintPhones<std::shared_ptr<Smartphone>>(n, name, [](PhoneFactory& f, const char* s) {
+                return f.createSmartphone(s);
+            });
+        }));
+        rows.push_back(MeasureFootprint(isLong ? "unique_ptr, long name" : "unique_ptr, short name",
+                                        sizeof(std::unique_ptr<Smartphone>), phones, [name](std::size_t n) {
+            return FootprintPhones<std::unique_ptr<Smartphone>>(n, name, [](PhoneFactory& f, const char* s) {
+                return f.createUniqueSmartphone(s);
+            });
+        }));
+        rows.push_back(MeasureFootprint(isLong ? "PhoneHandle, long name" : "PhoneHandle, short name",
+                                        sizeof(PhoneHandle<Smartphone>), phones, [name](std::size_t n) {
+            return FootprintPhones<PhoneHandle<Smartphone>>(n, name, [](PhoneFactory& f, const char* s) {
+                return f.createSmartphoneHandle(s);
+            });
+        }));
+        rows.push_back(MeasureFootprint(isLong ? "LazyPhone, long name" : "LazyPhone, short name", sizeof(LazyPhone),
+                                        phones, [name](std::size_t n) {
+            return FootprintPhones<LazyPhone>(n, name, [](PhoneFactory& f, const char* s) {
+                return f.createLazySmartphone(s);
+            });
+        }));
+    }
+    rows.push_back(MeasureFootprint("ProductBatch, long names", 0, phones, [longName](std::size_t n) {
+        std::vector<std::string_view> names(n, longName);
+        return PhoneFactorySingleton<NokiaFactory>().createSmartphones(names);
+    }));
+    benchTrackHeap.store(false);
+
+    std::printf("%-36s %8s %14s %12s\n", "Type", "sizeof", "heap B/elem", "allocs/elem");
+    for (const FootprintRow& row : rows) {
+        char size_text[32] = "-";
+        char heap_text[32] = "-";
+        char allocs_text[32] = "-";
+        if (row.objectBytes)
+            std::snprintf(size_text, sizeof(size_text), "%zu", row.objectBytes);
+        if (row.heapBytes || row.allocs) {
+            if (BenchHeapKnown)
+                std::snprintf(heap_text, sizeof(heap_text), "%.1f", row.heapBytes);
+            else
+                std::snprintf(heap_text, sizeof(heap_text), "n/a");
+            std::snprintf(allocs_text, sizeof(allocs_text), "%.3f", row.allocs);
+        }
+        std::printf("%-36s %8s %14s %12s\n", row.name, size_text, heap_text, allocs_text);
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--footprint") == 0) {
+        RunFootprintReport();
+        return 0;
+    }
+    const char* filter = argc > 1 ? argv[1] : "";
+    CacheMissCounter misses;
+    std::printf("%-36s %14s %12s %12s %12s %16s\n", "Benchmark", "ns/op", "Iterations", "allocs/op", "bytes/op",
+                "cache-misses/op");
+    for (const BenchCase& bench : BenchRegistry()) {
+        for (const auto& args : bench.argSets) {
+            std::string name = bench.name;
+            for (std::int64_t a : args)
+                name += "/" + std::to_string(a);
+            if (name.find(filter) != std::string::npos)
+                RunBenchCase(bench, args, misses);
+        }
+    }
+    return 0;
+}
+#elif defined(CP_TRPO_SELFTEST)
+// Самопроверки инвариантов, которые не видны по выводу программы.
+// Сборка: g++ -std=c++17 -O1 -pthread -DCP_TRPO_SELFTEST main.cpp -o selftest
+// (для гонок и ошибок памяти добавить -fsanitize=thread или -fsanitize=address,undefined)
+// Запуск: ./selftest [подстрока имени]; код возврата 1, если хоть одна проверка не прошла
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+#if defined(CP_TRPO_HAS_WRITEV)
+#include <pthread.h>
+#endif
+
+struct SelfTestCase {
+    const char* name;
+    void (*fn)();
+};
+
+static std::vector<SelfTestCase>& SelfTestRegistry() {
+    static std::vector<SelfTestCase> cases;
+    return cases;
+}
+
+struct SelfTestRegistrar {
+    SelfTestRegistrar(const char* name, void (*fn)()) { SelfTestRegistry().push_back(SelfTestCase{ name, fn }); }
+};
+
+#define CP_SELFTEST(fn) static SelfTestRegistrar fn##_selftest(#fn, fn)
+
+[[noreturn]] static void SelfTestFail(const char* file, int line, const char* expr) {
+    char text[256];
+    std::snprintf(text, sizeof(text), "%s:%d: %s", file, line, expr);
+    throw std::runtime_error(text);
+}
+
+// Проверка прерывает только свой тест, остальные выполняются
+#define CP_CHECK(cond) ((cond) ? (void)0 : SelfTestFail(__FILE__, __LINE__, #cond))
+
+static int ShapeSizeOf(const Shape& s) {
+    if (const Circle* c = dynamic_cast<const Circle*>(&s))
+        return c->GetRadius();
+    return static_cast<const Square&>(s).GetSide();
+}
+
+// Реплика совпадает с исходной сценой: то же число фигур, каждая живая ссылка указывает
+// на запись реплики с тем же типом, центром и размером
+static void CheckReplica(const DrwManager& m, const SceneReplica& replica) {
+    CP_CHECK(replica.count() == m.shapeCount());
+    for (ShapeType t : { ShapeType::Circle, ShapeType::Square }) {
+        std::size_t index = 0;
+        m.forEachOfType(t, [&](const Shape& s) {
+            const ShapeHandle h = m.handleAt(t, index++);
+            CP_CHECK(m.contains(h));
+            const SceneRecord* r = replica.find(h.slot);
+            CP_CHECK(r != nullptr);
+            CP_CHECK(r->type == static_cast<std::uint8_t>(t));
+            CP_CHECK(r->x == s.GetCenter().x && r->y == s.GetCenter().y);
+            CP_CHECK(r->size == ShapeSizeOf(s));
+        });
+        CP_CHECK(index == m.countOfType(t));
+    }
+}
+
+// Передаёт накопленную дельту зрителю через двоичный формат и сверяет реплику с источником
+static void ShipDelta(DrwManager& m, SceneReplica& replica, std::string& wire) {
+    const SceneDelta d = m.takeDelta();
+    wire.clear();
+    d.encode(wire);
+    CP_CHECK(replica.apply(wire.data(), wire.size()));
+    CheckReplica(m, replica);
+    // Повторное применение той же инкрементальной дельты отвергается по версии
+    CP_CHECK(d.reset || !replica.apply(wire.data(), wire.size()));
+}
+
+static std::vector<ShapeHandle> LiveHandles(const DrwManager& m) {
+    std::vector<ShapeHandle> handles;
+    for (ShapeType t : { ShapeType::Circle, ShapeType::Square })
+        for (std::size_t i = 0; i < m.countOfType(t); ++i)
+            handles.push_back(m.handleAt(t, i));
+    return handles;
+}
+
+// Случайные добавления, удаления, перемещения и compact() в режиме Packed; после каждой дельты
+// реплика зрителя совпадает с источником
+static void SelfTest_SceneDeltaChurn() {
+    std::mt19937 rng(7);
+    DrwManager m(StorageMode::Packed);
+    m.enableDeltaTracking();
+    SceneReplica replica;
+    std::string wire;
+    std::vector<ShapeHandle> handles = LiveHandles(m);
+    for (int step = 0; step < 20000; ++step) {
+        const unsigned op = rng() % 10;
+        if (op < 4) {
+            const Point c(static_cast<int>(rng() % 1000), static_cast<int>(rng() % 1000));
+            const int size = static_cast<int>(rng() % 9);
+            handles.push_back(rng() % 2 ? m.addCircle(c, size) : m.addSquare(c, size));
+        }
+        else if (op < 6 && !handles.empty()) {
+            const std::size_t k = rng() % handles.size();
+            CP_CHECK(m.removeShape(handles[k]));
+            handles[k] = handles.back();
+            handles.pop_back();
+        }
+        else if (op < 8 && !handles.empty()) {
+            m.setCenter(handles[rng() % handles.size()], Point(static_cast<int>(rng() % 50), static_cast<int>(rng() % 50)));
+        }
+        else if (!handles.empty()) {
+            m.setSize(handles[rng() % handles.size()], static_cast<int>(rng() % 20));
+        }
+        if (step % 1000 == 999) {
+            m.removeIf([](const Shape& s) { return s.GetCenter().x % 7 == 0; });
+            m.compact();
+            handles = LiveHandles(m);
+        }
+        if (step == 12345) {
+            m.clear();
+            handles.clear();
+        }
+        if (rng() % 50 == 0)
+            ShipDelta(m, replica, wire);
+    }
+    ShipDelta(m, replica, wire);
+}
+CP_SELFTEST(SelfTest_SceneDeltaChurn);
+
+// Повреждённая дельта (каждый бит по очереди) не роняет зрителя и не раздувает его память;
+// огромный номер ячейки стоит одной записи: отображение ячеек разреженное
+static void SelfTest_SceneDeltaRejectsCorruptData() {
+    DrwManager m(StorageMode::Packed);
+    m.enableDeltaTracking();
+    SceneReplica base;
+    std::string wire;
+    ShipDelta(m, base, wire);
+    const ShapeHandle a = m.addCircle(Point(1, 2), 3);
+    m.addSquare(Point(4, 5), 6);
+    m.setCenter(a, Point(7, 8));
+    const SceneDelta d = m.takeDelta();
+    wire.clear();
+    d.encode(wire);
+    for (std::size_t bit = 0; bit < wire.size() * 8; ++bit) {
+        std::string bad = wire;
+        bad[bit / 8] = static_cast<char>(bad[bit / 8] ^ (1 << (bit % 8)));
+        SceneReplica replica = base;
+        replica.apply(bad.data(), bad.size());
+        CP_CHECK(replica.count() <= base.count() + d.changes.size());
+    }
+
+    SceneDelta huge;
+    huge.fromVersion = base.version();
+    huge.toVersion = base.version() + 1;
+    huge.changes.push_back(ShapeChange{ DeltaOp::Add, ShapeType::Circle, ShapeHandle{ 1000, 1 }, Point(1, 1), 1 });
+    huge.changes.push_back(ShapeChange{ DeltaOp::Add, ShapeType::Circle, ShapeHandle{ 0xfffffff0u, 1 }, Point(1, 1), 1 });
+    SceneReplica replica = base;
+    CP_CHECK(replica.apply(huge));
+    CP_CHECK(replica.count() == base.count() + 2 && replica.version() == base.version() + 1);
+    CP_CHECK(replica.contains(0xfffffff0u) && !replica.contains(0xffffffefu));
+    wire.clear();
+    huge.encode(wire);
+    SceneDelta decoded;
+    CP_CHECK(decoded.decode(wire.data(), wire.size()) && decoded.changes.size() == 2);
+    SceneReplica fromWire = base;
+    CP_CHECK(fromWire.apply(wire.data(), wire.size()) && fromWire.count() == replica.count());
+
+    // Удаление записи с огромным номером освобождает её, остальные записи остаются доступны
+    SceneDelta drop;
+    drop.fromVersion = replica.version();
+    drop.toVersion = replica.version() + 1;
+    drop.changes.push_back(ShapeChange{ DeltaOp::Remove, ShapeType::Circle, ShapeHandle{ 0xfffffff0u, 1 }, Point(), 0 });
+    CP_CHECK(replica.apply(drop));
+    CP_CHECK(replica.count() == base.count() + 1 && !replica.contains(0xfffffff0u) && replica.find(1000) != nullptr);
+}
+CP_SELFTEST(SelfTest_SceneDeltaRejectsCorruptData);
+
+// Освободившаяся ячейка достаётся новой фигуре с новым поколением: зритель получает замену,
+// старая ссылка больше не действует
+static void SelfTest_SceneDeltaSlotReuse() {
+    DrwManager m(StorageMode::Packed);
+    m.enableDeltaTracking();
+    SceneReplica replica;
+    std::string wire;
+    const ShapeHandle a = m.addCircle(Point(1, 1), 3);
+    const ShapeHandle b = m.addSquare(Point(2, 2), 4);
+    ShipDelta(m, replica, wire);
+
+    CP_CHECK(m.removeShape(a));
+    const ShapeHandle c = m.addSquare(Point(5, 5), 6);
+    CP_CHECK(c.slot == a.slot && c.generation != a.generation);
+    CP_CHECK(!m.contains(a) && m.contains(c));
+    ShipDelta(m, replica, wire);
+    CP_CHECK(replica.find(c.slot)->type == static_cast<std::uint8_t>(ShapeType::Square));
+
+    // Удаление и повторное занятие ячейки между двумя дельтами
+    CP_CHECK(m.removeShape(c));
+    const ShapeHandle d = m.addCircle(Point(7, 7), 8);
+    CP_CHECK(d.slot == c.slot && d.generation != c.generation);
+    m.setCenter(b, Point(9, 9));
+    ShipDelta(m, replica, wire);
+}
+CP_SELFTEST(SelfTest_SceneDeltaSlotReuse);
+
+// compact() отбрасывает свободные ячейки в конце таблицы; новые фигуры в этих ячейках получают
+// поколения выше отброшенных, и дельта после compact() продолжает реплику
+static void SelfTest_SceneDeltaAfterCompact() {
+    DrwManager m(StorageMode::Packed);
+    m.enableDeltaTracking();
+    SceneReplica replica;
+    std::string wire;
+    std::vector<ShapeHandle> handles = LiveHandles(m);
+    for (int i = 0; i < 64; ++i)
+        handles.push_back(m.addCircle(Point(i, i), i % 5));
+    ShipDelta(m, replica, wire);
+
+    const ShapeHandle last = handles.back();
+    for (std::size_t i = handles.size() / 2; i < handles.size(); ++i)
+        CP_CHECK(m.removeShape(handles[i]));
+    handles.resize(handles.size() / 2);
+    m.compact();
+    ShipDelta(m, replica, wire);
+
+    const ShapeHandle fresh = m.addSquare(Point(3, 4), 5);
+    CP_CHECK(!m.contains(last));
+    CP_CHECK(fresh.slot != last.slot || fresh.generation > last.generation);
+    m.setSize(handles.front(), 11);
+    ShipDelta(m, replica, wire);
+
+    // Дельта, накопленная через compact() и новые добавления сразу
+    for (int i = 0; i < 40; ++i)
+        handles.push_back(m.addSquare(Point(-i, i), 2));
+    for (std::size_t i = 0; i < handles.size(); i += 3)
+        m.removeShape(handles[i]);
+    m.compact();
+    m.addCircle(Point(100, 100), 1);
+    ShipDelta(m, replica, wire);
+}
+CP_SELFTEST(SelfTest_SceneDeltaAfterCompact);
+
+// Пакетные ядра против прямого перебора по Circle::BoundsAt / Square::BoundsAt и точному целочисленному
+// попаданию в круг. Длины не кратны ширине вектора, размеры бывают отрицательными и нечётными.
+// Векторный путь проверяется только в сборке с -mavx2 (или -march=native)
+static void SelfTest_GeometryKernelsMatchScalar() {
+    std::mt19937 rng(11);
+    const int coordRange = 1 << 25; // попадание в круг в double точно при разностях меньше 2^26
+    auto coord = [&] { return static_cast<int>(rng() % (2u * coordRange)) - coordRange; };
+    auto small = [&] { return static_cast<int>(rng() % 2001) - 1000; };
+    for (int round = 0; round < 200; ++round) {
+        const std::size_t n = rng() % 70;
+        const bool near = round % 2 == 0; // плотная сцена, чтобы попадания были часты
+        std::vector<int> x(n), y(n), size(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            x[i] = near ? small() : coord();
+            y[i] = near ? small() : coord();
+            size[i] = static_cast<int>(rng() % (near ? 401 : 1u << 20)) - (near ? 50 : 1 << 16);
+        }
+        for (ShapeType t : { ShapeType::Circle, ShapeType::Square }) {
+            auto boundsAt = [&](std::size_t i) {
+                const Point c(x[i], y[i]);
+                return t == ShapeType::Circle ? Circle::BoundsAt(c, size[i]) : Square::BoundsAt(c, size[i]);
+            };
+
+            BoundsColumns b;
+            b.resize(n);
+            ComputeBoundsBatch(t, x.data(), y.data(), size.data(), n, b.minX.data(), b.minY.data(), b.maxX.data(),
+                               b.maxY.data());
+            for (std::size_t i = 0; i < n; ++i) {
+                const Rect r = boundsAt(i);
+                CP_CHECK(b.minX[i] == r.minX && b.minY[i] == r.minY && b.maxX[i] == r.maxX && b.maxY[i] == r.maxY);
+            }
+
+            const int vx = near ? small() : coord(), vy = near ? small() : coord();
+            const Rect view{ vx, vy, vx + static_cast<int>(rng() % 500), vy + static_cast<int>(rng() % 500) };
+            std::vector<std::uint32_t> got, want;
+            IntersectBatch(t, x.data(), y.data(), size.data(), n, view, got);
+            for (std::size_t i = 0; i < n; ++i) {
+                const Rect r = boundsAt(i);
+                if (r.minX <= view.maxX && view.minX <= r.maxX && r.minY <= view.maxY && view.minY <= r.maxY)
+                    want.push_back(static_cast<std::uint32_t>(i));
+            }
+            CP_CHECK(got == want);
+
+            const Point p(near ? small() : coord(), near ? small() : coord());
+            got.clear();
+            want.clear();
+            HitTestBatch(t, x.data(), y.data(), size.data(), n, p, got);
+            for (std::size_t i = 0; i < n; ++i) {
+                bool hit;
+                if (t == ShapeType::Circle) {
+                    const std::int64_t dx = std::int64_t(x[i]) - p.x, dy = std::int64_t(y[i]) - p.y, r = size[i];
+                    hit = dx * dx + dy * dy <= r * r;
+                }
+                else {
+                    const Rect r = boundsAt(i);
+                    hit = r.minX <= p.x && p.x <= r.maxX && r.minY <= p.y && p.y <= r.maxY;
+                }
+                if (hit)
+                    want.push_back(static_cast<std::uint32_t>(i));
+            }
+            CP_CHECK(got == want);
+        }
+    }
+
+    // Размер INT_MIN: модуль сводится к INT_MAX (SizeMagnitude), векторный путь совпадает со скалярным
+    const std::size_t n = 9;
+    const std::vector<int> zero(n, 0), minSize(n, std::numeric_limits<int>::min());
+    for (ShapeType t : { ShapeType::Circle, ShapeType::Square }) {
+        BoundsColumns b;
+        b.resize(n);
+        ComputeBoundsBatch(t, zero.data(), zero.data(), minSize.data(), n, b.minX.data(), b.minY.data(),
+                           b.maxX.data(), b.maxY.data());
+        const Rect r = t == ShapeType::Circle ? Circle::BoundsAt(Point(0, 0), minSize[0])
+                                              : Square::BoundsAt(Point(0, 0), minSize[0]);
+        CP_CHECK(r.minX <= r.maxX && r.minY <= r.maxY);
+        for (std::size_t i = 0; i < n; ++i)
+            CP_CHECK(b.minX[i] == r.minX && b.minY[i] == r.minY && b.maxX[i] == r.maxX && b.maxY[i] == r.maxY);
+    }
+}
+CP_SELFTEST(SelfTest_GeometryKernelsMatchScalar);
+
+// Конвейер кадров: вывод через фоновый поток совпадает с последовательным drawShapes(), метки кадров
+// опрашиваются из другого потока. Гонки проверяются сборкой с -fsanitize=thread
+static void SelfTest_FramePipelineMatchesSerial() {
+    const int frames = 200;
+    auto fill = [](DrwManager& m) {
+        for (int i = 0; i < 2000; ++i) {
+            if (i % 2)
+                m.addSquare(Point(i, -i), 2 + i % 5);
+            else
+                m.addCircle(Point(i, 0), 1 + i % 3);
+        }
+    };
+    // Каждый кадр меняет центр круга и сторону квадрата; двоичный вывод несёт центры и размеры,
+    // поэтому устаревший или недописанный буфер кадра не совпадёт с последовательным рисованием
+    auto change = [](DrwManager& m, int f) {
+        m.setCenter(ShapeType::Circle, f, Point(-f, f));
+        m.setSize(ShapeType::Square, f, 100 + f);
+    };
+
+    DrwManager serial(StorageMode::Packed);
+    fill(serial);
+    std::ostringstream want;
+    {
+        BinaryRenderSink sink(want);
+        for (int f = 0; f < frames; ++f) {
+            change(serial, f);
+            serial.drawShapes(sink);
+        }
+    }
+
+    DrwManager piped(StorageMode::Packed);
+    fill(piped);
+    std::ostringstream got;
+    {
+        BinaryRenderSink sink(got);
+        FramePipeline pipeline(sink);
+        std::vector<FrameFence> fences(frames);
+        std::atomic<int> published(0);
+        std::atomic<bool> watcherOk(true);
+        // Второй поток ждёт каждый кадр по метке и проверяет, что кадры завершаются по порядку
+        std::thread watcher([&] {
+            for (int f = 0; f < frames; ++f) {
+                while (published.load(std::memory_order_acquire) <= f)
+                    std::this_thread::yield();
+                fences[f].wait();
+                if (!fences[f].ready() || pipeline.completedFrames() < std::uint64_t(f) + 1)
+                    watcherOk = false;
+            }
+        });
+        for (int f = 0; f < frames; ++f) {
+            change(piped, f);
+            fences[f] = piped.drawShapesAsync(pipeline);
+            published.store(f + 1, std::memory_order_release);
+        }
+        watcher.join();
+        pipeline.wait();
+        CP_CHECK(watcherOk.load());
+        CP_CHECK(pipeline.submittedFrames() == std::uint64_t(frames));
+        CP_CHECK(pipeline.completedFrames() == std::uint64_t(frames));
+    }
+    CP_CHECK(got.str() == want.str());
+
+    // Конвейер без кадров останавливается сразу
+    std::ostringstream none;
+    {
+        TextRenderSink sink(none);
+        FramePipeline pipeline(sink);
+    }
+    CP_CHECK(none.str().empty());
+}
+CP_SELFTEST(SelfTest_FramePipelineMatchesSerial);
+
+// Приёмник, бросающий на заданном кадре: ошибка из потока вывода доходит до вызывающего.
+// Счётчик трогает только поток конвейера
+class ThrowingSink : public RenderSink {
+public:
+    ThrowingSink(std::ostream& os, int failFrame) : RenderSink(os), failAt(failFrame) {}
+
+    void Encode(const CommandBuffer&, std::string& dst) const override {
+        if (encoded++ == failAt)
+            throw std::runtime_error("sink failure");
+        dst += "frame\n";
+    }
+
+private:
+    int failAt;
+    mutable int encoded = 0;
+};
+
+static void SelfTest_FramePipelinePropagatesErrors() {
+    DrwManager m(StorageMode::Packed);
+    m.addCircle(Point(1, 1), 1);
+    std::ostringstream os;
+    ThrowingSink sink(os, 2);
+    bool caught = false;
+    try {
+        FramePipeline pipeline(sink);
+        for (int f = 0; f < 6; ++f)
+            m.drawShapesAsync(pipeline);
+        pipeline.wait();
+    } catch (const std::runtime_error&) {
+        caught = true;
+    }
+    CP_CHECK(caught);
+}
+CP_SELFTEST(SelfTest_FramePipelinePropagatesErrors);
+
+// Временная std::string: короткая копируется в объект, у длинной забирается буфер без копии символов;
+// копирование, перемещение и присваивание таких имён не теряют и не разделяют память
+static void SelfTest_PhoneNameAdoptsRvalueStrings() {
+    std::string longName(40, 'x');
+    longName += " Smartphone";
+    const char* buffer = longName.data();
+    PhoneName adopted(std::move(longName));
+    CP_CHECK(adopted.view().data() == buffer);
+    CP_CHECK(adopted.view() == std::string(40, 'x') + " Smartphone");
+
+    PhoneName copy(adopted);
+    CP_CHECK(copy.view() == adopted.view() && copy.view().data() != buffer);
+    PhoneName moved(std::move(adopted));
+    CP_CHECK(moved.view().data() == buffer && adopted.view().empty());
+    copy = std::move(moved);
+    CP_CHECK(copy.view().data() == buffer);
+    PhoneName kept = std::move(copy).keep();
+    CP_CHECK(kept.view().data() == buffer);
+
+    PhoneName small(std::string("Nokia 3310"));
+    CP_CHECK(small.view() == "Nokia 3310");
+    PhoneName smallCopy(small);
+    CP_CHECK(smallCopy.view() == "Nokia 3310" && smallCopy.view().data() != small.view().data());
+}
+CP_SELFTEST(SelfTest_PhoneNameAdoptsRvalueStrings);
+
+// Таблица имён: чтение по номеру без блокировки, пока другой поток добавляет имена (проверяется с
+// -fsanitize=thread), повторы получают тот же номер, заполненная таблица новых имён не принимает
+static void SelfTest_NameTableBoundedLockFreeLookup() {
+    const std::size_t names = NameTable::ChunkSize * 3 + 17;
+    NameTable table(names);
+    CP_CHECK(table.capacity() == names);
+    std::atomic<bool> done(false);
+    std::atomic<bool> readerOk(true);
+    std::thread reader([&] {
+        while (!done.load(std::memory_order_acquire)) {
+            const std::size_t n = table.size();
+            for (std::size_t id = n > 64 ? n - 64 : 0; id < n; ++id)
+                if (table.lookup(static_cast<std::uint32_t>(id)) != "name " + std::to_string(id))
+                    readerOk = false;
+        }
+    });
+    for (std::size_t i = 0; i < names; ++i)
+        CP_CHECK(table.internId("name " + std::to_string(i)) == i);
+    done.store(true, std::memory_order_release);
+    reader.join();
+    CP_CHECK(readerOk.load());
+
+    CP_CHECK(table.size() == names);
+    CP_CHECK(table.internId("name 5") == 5);
+    std::uint32_t id = 0;
+    CP_CHECK(!table.tryInternId("one more", id));
+    bool thrown = false;
+    try {
+        table.internId("one more");
+    } catch (const std::length_error&) {
+        thrown = true;
+    }
+    CP_CHECK(thrown && table.size() == names);
+    CP_CHECK(table.lookup(static_cast<std::uint32_t>(names)).empty());
+}
+CP_SELFTEST(SelfTest_NameTableBoundedLockFreeLookup);
+
+// Пространственный индекс против линейного отбора, вывод сравнивается в двоичном виде (код, центр, размер):
+// индекс отдаёт фигуры в том же порядке, что и линейный проход. Крупные фигуры (миллиарды ячеек при шаге сетки 1)
+// уходят в общий список, окно во всю плоскость int не переполняет подсчёт ячеек,
+// фигуры с отрицательным размером находятся обоими путями
+static void SelfTest_SpatialGridMatchesLinearScan() {
+    std::mt19937 rng(5);
+    DrwManager indexed(StorageMode::Packed);
+    DrwManager linear(StorageMode::Packed);
+    indexed.enableSpatialIndex(1);
+    std::vector<ShapeHandle> handles;
+    auto coord = [&] { return static_cast<int>(rng() % 20001) - 10000; };
+    auto size = [&] {
+        const int s = rng() % 16 == 0 ? (1 << 29) + static_cast<int>(rng() % 1000) : static_cast<int>(rng() % 40);
+        return rng() % 8 == 0 ? -s : s;
+    };
+    const Rect views[] = {
+        Rect{ INT_MIN, INT_MIN, INT_MAX, INT_MAX },
+        Rect{ -100, -100, 100, 100 },
+        Rect{ 5000, -3000, 5010, 9000 },
+        Rect{ 2000000000, 2000000000, INT_MAX, INT_MAX },
+    };
+    auto compare = [&] {
+        for (const Rect& view : views) {
+            std::ostringstream a, b;
+            BinaryRenderSink sa(a), sb(b);
+            indexed.drawShapes(view, sa);
+            linear.drawShapes(view, sb);
+            CP_CHECK(a.str() == b.str());
+        }
+    };
+    for (int step = 0; step < 3000; ++step) {
+        const unsigned op = rng() % 8;
+        if (op < 4 || handles.empty()) {
+            const Point c(coord(), coord());
+            const int s = size();
+            const bool circle = rng() % 2 != 0;
+            const ShapeHandle h = circle ? indexed.addCircle(c, s) : indexed.addSquare(c, s);
+            CP_CHECK(h == (circle ? linear.addCircle(c, s) : linear.addSquare(c, s)));
+            handles.push_back(h);
+        }
+        else if (op < 6) {
+            const std::size_t k = rng() % handles.size();
+            CP_CHECK(indexed.removeShape(handles[k]) && linear.removeShape(handles[k]));
+            handles[k] = handles.back();
+            handles.pop_back();
+        }
+        else if (op < 7) {
+            const ShapeHandle h = handles[rng() % handles.size()];
+            const Point c(coord(), coord());
+            indexed.setCenter(h, c);
+            linear.setCenter(h, c);
+        }
+        else {
+            const ShapeHandle h = handles[rng() % handles.size()];
+            const int s = size();
+            indexed.setSize(h, s);
+            linear.setSize(h, s);
+        }
+        if (step % 100 == 0)
+            compare();
+    }
+    compare();
+
+    // Отрицательный размер - тот же прямоугольник с упорядоченными краями, оба пути его находят.
+    // Фигуры вдали от начальной сцены конструктора в (0, 0)
+    DrwManager negIndexed(StorageMode::Packed);
+    DrwManager negLinear(StorageMode::Packed);
+    negIndexed.enableSpatialIndex(4);
+    for (DrwManager* m : { &negIndexed, &negLinear }) {
+        m->addSquare(Point(1000, 0), -20);
+        m->addCircle(Point(1100, 0), -10);
+    }
+    for (const Rect& view : { Rect{ 1005, 5, 1006, 6 }, Rect{ 1105, -5, 1106, -4 }, Rect{ 991, -9, 1109, 9 } }) {
+        std::ostringstream a, b;
+        BinaryRenderSink sa(a), sb(b);
+        negIndexed.drawShapes(view, sa);
+        negLinear.drawShapes(view, sb);
+        const std::string drawn = a.str();
+        CP_CHECK(drawn == b.str());
+        const std::size_t commands = (drawn.size() - 4) / BinaryRenderSink::RecordSize;
+        CP_CHECK(commands == 1u + (view.maxX > 1100 && view.minX < 1010));
+    }
+}
+CP_SELFTEST(SelfTest_SpatialGridMatchesLinearScan);
+
+// drawDirty() совпадает с drawShapes() команда в команду (код, центр, размер) с учётом изменений и без него;
+// без учёта изменения ничего не отмечают
+static void SelfTest_DrawDirtyMatchesDrawShapes() {
+    for (bool tracking : { false, true }) {
+        std::mt19937 rng(3);
+        DrwManager m(StorageMode::Packed);
+        if (tracking)
+            m.enableDirtyTracking();
+        std::vector<ShapeHandle> handles = LiveHandles(m);
+        for (int step = 0; step < 2000; ++step) {
+            const unsigned op = rng() % 6;
+            const Point c(static_cast<int>(rng() % 100), static_cast<int>(rng() % 100));
+            if (op < 2 || handles.empty()) {
+                handles.push_back(rng() % 2 ? m.addCircle(c, 1) : m.addSquare(c, 2));
+            }
+            else if (op < 3) {
+                const std::size_t k = rng() % handles.size();
+                m.removeShape(handles[k]);
+                handles[k] = handles.back();
+                handles.pop_back();
+            }
+            else if (op < 5) {
+                m.setCenter(handles[rng() % handles.size()], c);
+            }
+            else {
+                m.setSize(handles[rng() % handles.size()], static_cast<int>(rng() % 9));
+            }
+            CP_CHECK(tracking || m.dirtyCount() == 0);
+            if (step % 37 == 0) {
+                // Двоичный вывод несёт центры и размеры: устаревшая команда из кэша кадра не совпадёт
+                std::ostringstream a, b;
+                BinaryRenderSink sa(a), sb(b);
+                m.drawDirty(sa);
+                m.drawShapes(sb);
+                CP_CHECK(a.str() == b.str());
+                CP_CHECK(m.dirtyCount() == 0);
+            }
+        }
+    }
+}
+CP_SELFTEST(SelfTest_DrawDirtyMatchesDrawShapes);
+
+// SceneFile принимает файл только точного размера: заголовок и header.count записей
+static void SelfTest_SceneFileRejectsBadSizes() {
+    const std::string path = "cp_trpo_selftest_sizes.bin";
+    const SceneRecord records[] = { MakeSceneRecord(ShapeType::Circle, Point(1, 2), 3),
+                                    MakeSceneRecord(ShapeType::Square, Point(4, 5), 6) };
+    CP_CHECK(SceneFile::write(path, records, 2));
+    std::string exact;
+    {
+        std::ifstream in(path, std::ios::binary);
+        exact.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    auto opens = [&](const std::string& bytes) {
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+        }
+        SceneFile file;
+        return file.open(path);
+    };
+    CP_CHECK(opens(exact));
+    for (std::size_t extra = 1; extra <= sizeof(SceneRecord); ++extra)
+        CP_CHECK(!opens(exact + std::string(extra, '\0')));
+    for (std::size_t cut = 1; cut < exact.size(); ++cut)
+        CP_CHECK(!opens(exact.substr(0, exact.size() - cut)));
+    // Число записей, при котором размер не помещается в 64 бита
+    std::string huge = exact;
+    const std::uint64_t count = UINT64_MAX / sizeof(SceneRecord) + 2;
+    for (int k = 0; k < 8; ++k)
+        huge[8 + k] = static_cast<char>(count >> (8 * k));
+    CP_CHECK(!opens(huge));
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_SceneFileRejectsBadSizes);
+
+// Файл сцены в little-endian независимо от процессора: байты заголовка и записи на диске,
+// затем чтение через SceneFile и drawStream()
+static void SelfTest_SceneFileIsLittleEndian() {
+    const std::string path = "cp_trpo_selftest_scene.bin";
+    const SceneRecord records[] = { MakeSceneRecord(ShapeType::Circle, Point(0x01020304, -2), 0x0a0b0c0d) };
+    CP_CHECK(SceneFile::write(path, records, 1));
+
+    std::string bytes;
+    {
+        std::ifstream in(path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    const unsigned char* b = reinterpret_cast<const unsigned char*>(bytes.data());
+    CP_CHECK(bytes.size() == sizeof(SceneHeader) + sizeof(SceneRecord));
+    CP_CHECK(std::memcmp(b, "CPSC", 4) == 0);
+    CP_CHECK(b[4] == 1 && b[5] == 0 && b[6] == 0 && b[7] == 0); // версия
+    CP_CHECK(b[8] == 1 && b[9] == 0 && b[15] == 0);             // число записей
+    CP_CHECK(b[16] == 0x04 && b[17] == 0x03 && b[18] == 0x02 && b[19] == 0x01);
+    CP_CHECK(b[20] == 0xfe && b[23] == 0xff);
+    CP_CHECK(b[24] == 0x0d && b[27] == 0x0a);
+
+    SceneFile file;
+    CP_CHECK(file.open(path) && file.count() == 1);
+    CP_CHECK(file.records()[0].x == 0x01020304 && file.records()[0].y == -2 && file.records()[0].size == 0x0a0b0c0d);
+
+    DrwManager m(StorageMode::Packed);
+    m.clear();
+    std::ostringstream got;
+    {
+        std::ifstream in(path, std::ios::binary);
+        TextRenderSink sink(got);
+        CP_CHECK(m.drawStream(in, sink) == 1);
+    }
+    std::ostringstream want;
+    {
+        TextRenderSink sink(want);
+        sink.Push(Circle::CommandAt(Point(0x01020304, -2), 0x0a0b0c0d));
+        sink.Flush();
+    }
+    CP_CHECK(got.str() == want.str());
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_SceneFileIsLittleEndian);
+
+// Параллельное рисование совпадает с drawShapes() байт в байт во всех режимах хранения,
+// в том числе когда кусок больше всей сцены
+static void SelfTest_DrawShapesParallelMatchesSerial() {
+    const std::string path = "cp_trpo_selftest_parallel.bin";
+    {
+        DrwManager source(StorageMode::Packed);
+        for (int i = 0; i < 1500; ++i)
+            source.addCircle(Point(i, -i), i % 7);
+        CP_CHECK(source.saveScene(path));
+    }
+    WorkStealingPool pool(4);
+    const StorageMode modes[] = { StorageMode::List, StorageMode::Packed, StorageMode::Arena, StorageMode::Variant,
+                                  StorageMode::Mapped };
+    for (StorageMode mode : modes) {
+        DrwManager m(mode);
+        if (mode == StorageMode::Mapped)
+            CP_CHECK(m.loadScene(path));
+        for (int i = 0; i < 2500; ++i) {
+            if (i % 3 == 0)
+                m.addSquare(Point(i, i / 2), i % 11);
+            else
+                m.addCircle(Point(-i, i), i % 5);
+        }
+        std::ostringstream want;
+        {
+            BinaryRenderSink sink(want);
+            m.drawShapes(sink);
+        }
+        for (std::size_t chunk : { std::size_t(1), std::size_t(3), std::size_t(64), std::size_t(5000),
+                                   std::size_t(100000) }) {
+            std::ostringstream got;
+            {
+                BinaryRenderSink sink(got);
+                m.drawShapesParallel(pool, sink, chunk);
+            }
+            CP_CHECK(got.str() == want.str());
+        }
+    }
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_DrawShapesParallelMatchesSerial);
+
+#if defined(CP_TRPO_HAS_WRITEV)
+static std::string RandomBytes(std::mt19937& rng, std::size_t n) {
+    std::string s(n, '\0');
+    for (char& c : s)
+        c = static_cast<char>(rng());
+    return s;
+}
+
+// BufferedWriter с маленьким буфером над FdWriter в файл: куски случайной длины, в том числе
+// переходящие через границу буфера и больше него, WriteV() с числом кусков больше FdWriter::MaxParts
+static void SelfTest_BufferedWriterToFileKeepsBytes() {
+    const std::string path = "cp_trpo_selftest_writer.bin";
+    std::mt19937 rng(17);
+    for (std::size_t capacity : { std::size_t(2), std::size_t(7), std::size_t(64), std::size_t(4096) }) {
+        std::string want;
+        {
+            FdWriter file;
+            CP_CHECK(file.open(path));
+            BufferedWriter out(file, capacity);
+            for (int i = 0; i < 2000; ++i) {
+                const std::size_t n = rng() % 8 == 0 ? rng() % (3 * capacity + 1) : rng() % (capacity + 2);
+                const std::string chunk = RandomBytes(rng, n);
+                out.Write(chunk);
+                want += chunk;
+                if (i % 500 == 499) {
+                    std::vector<std::string> parts;
+                    std::vector<std::string_view> views;
+                    for (int k = 0; k < 150; ++k)
+                        parts.push_back(RandomBytes(rng, rng() % 40));
+                    for (const std::string& p : parts) {
+                        views.push_back(p);
+                        want += p;
+                    }
+                    out.Flush();
+                    file.WriteV(views.data(), views.size());
+                }
+            }
+            out.Flush();
+        }
+        std::ifstream in(path, std::ios::binary);
+        const std::string got((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        CP_CHECK(got == want);
+    }
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_BufferedWriterToFileKeepsBytes);
+
+static void SelfTestIgnoreSignal(int) {}
+
+// Частичные writev и EINTR: запись в канал, который поток-читатель опустошает, пока пишущий поток
+// прерывается сигналами (обработчик без SA_RESTART). Прочитанное совпадает с записанным
+static void SelfTest_FdWriterSurvivesPartialWrites() {
+    int fds[2];
+    CP_CHECK(pipe(fds) == 0);
+#if defined(F_SETPIPE_SZ)
+    fcntl(fds[1], F_SETPIPE_SZ, 4096);
+#endif
+    struct sigaction action, previous;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = SelfTestIgnoreSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, &previous);
+
+    std::string got;
+    std::thread reader([&] {
+        char chunk[1024];
+        for (;;) {
+            const ssize_t r = read(fds[0], chunk, sizeof(chunk));
+            if (r > 0)
+                got.append(chunk, static_cast<std::size_t>(r));
+            else if (r == 0 || errno != EINTR)
+                break;
+        }
+    });
+    const pthread_t writerThread = pthread_self();
+    std::atomic<bool> writing(true);
+    std::thread interrupter([&] {
+        while (writing.load()) {
+            pthread_kill(writerThread, SIGUSR1);
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+
+    std::mt19937 rng(23);
+    std::string want;
+    {
+        FdWriter pipeOut(fds[1]);
+        BufferedWriter out(pipeOut, 512);
+        for (int i = 0; i < 300; ++i) {
+            const std::string chunk = RandomBytes(rng, rng() % 20000);
+            out.Write(chunk);
+            want += chunk;
+        }
+        out.Flush();
+    }
+    writing = false;
+    interrupter.join();
+    ::close(fds[1]);
+    reader.join();
+    ::close(fds[0]);
+    sigaction(SIGUSR1, &previous, nullptr);
+    CP_CHECK(got == want);
+}
+CP_SELFTEST(SelfTest_FdWriterSurvivesPartialWrites);
+#endif
+
+// Продукт, считающий живые экземпляры: по нему видно, когда PhoneHandle освобождает блок
+class CountedPhone final : public Smartphone {
+public:
+    explicit CountedPhone(std::string_view n) : name(n) { ++alive; }
+    ~CountedPhone() override { --alive; }
+    std::string_view getName() const override { return name; }
+
+    static int alive;
+
+private:
+    std::string_view name;
+};
+int CountedPhone::alive = 0;
+
+// PhoneHandle: копирование и перемещение меняют счётчик ссылок, reset() и уход последней ссылки
+// уничтожают продукт, хендл базового типа делит счётчик с исходным
+static void SelfTest_PhoneHandleRefCounting() {
+    {
+        PhoneHandle<CountedPhone> a = PhoneHandle<CountedPhone>::Make("Counted");
+        CP_CHECK(CountedPhone::alive == 1 && a.useCount() == 1 && a->getName() == "Counted");
+
+        PhoneHandle<CountedPhone> b(a);
+        CP_CHECK(a.useCount() == 2 && b.get() == a.get());
+        PhoneHandle<Phone> base(a);
+        CP_CHECK(a.useCount() == 3 && base.useCount() == 3 && base->getName() == "Counted");
+        PhoneHandle<Smartphone> middle = b;
+        CP_CHECK(middle.useCount() == 4);
+
+        PhoneHandle<CountedPhone> moved(std::move(b));
+        CP_CHECK(!b && b.useCount() == 0 && moved.useCount() == 4);
+        PhoneHandle<Phone> movedBase(std::move(middle));
+        CP_CHECK(!middle && movedBase.useCount() == 4);
+
+        moved.reset();
+        movedBase.reset();
+        base = PhoneHandle<Phone>();
+        CP_CHECK(!moved && a.useCount() == 1 && CountedPhone::alive == 1);
+
+        base = a;
+        CP_CHECK(a.useCount() == 2);
+        a = a; // присваивание себе не меняет счётчик
+        CP_CHECK(a.useCount() == 2);
+        a.reset();
+        CP_CHECK(CountedPhone::alive == 1 && base.useCount() == 1);
+        base.reset();
+        CP_CHECK(CountedPhone::alive == 0 && base.useCount() == 0);
+    }
+    CP_CHECK(CountedPhone::alive == 0);
+
+    NokiaFactory factory;
+    PhoneHandle<Smartphone> phone = factory.createSmartphoneHandle("Nokia Handle");
+    PhoneHandle<Phone> copy(phone);
+    CP_CHECK(phone.useCount() == 2 && copy->getName() == "Nokia Handle");
+    copy.reset();
+    CP_CHECK(phone.useCount() == 1);
+}
+CP_SELFTEST(SelfTest_PhoneHandleRefCounting);
+
+// Продукт другого размера: его блоки идут мимо пула
+class WideCountedPhone final : public Smartphone {
+public:
+    std::string_view getName() const override { return "Wide"; }
+
+private:
+    char payload[200] = {};
+};
+
+// ProductPool: повторное использование блоков, предел свободного списка, запросы другого размера
+// и пул, уничтоженный раньше своих продуктов (утечки и обращения к освобождённой памяти ловит ASan)
+static void SelfTest_ProductPoolStats() {
+    std::shared_ptr<CountedPhone> survivor;
+    {
+        ProductPool pool(2);
+        {
+            std::vector<std::shared_ptr<CountedPhone>> phones;
+            for (int i = 0; i < 3; ++i)
+                phones.push_back(pool.make<CountedPhone>("Pooled"));
+            CP_CHECK(pool.stats().misses == 3 && pool.stats().hits == 0);
+        }
+        PoolStats s = pool.stats();
+        CP_CHECK(s.releases == 2 && s.trimmed == 1 && s.freeBlocks == 2);
+
+        {
+            std::shared_ptr<CountedPhone> a = pool.make<CountedPhone>("Again");
+            std::shared_ptr<CountedPhone> b = pool.make<CountedPhone>("Again");
+            s = pool.stats();
+            CP_CHECK(s.hits == 2 && s.misses == 3 && s.freeBlocks == 0);
+            // Блок другого размера не попадает в свободный список и не считается вытесненным
+            std::shared_ptr<WideCountedPhone> wide = pool.make<WideCountedPhone>();
+            CP_CHECK(pool.stats().misses == 4);
+        }
+        s = pool.stats();
+        CP_CHECK(s.releases == 4 && s.trimmed == 1 && s.freeBlocks == 2);
+
+        pool.trim();
+        s = pool.stats();
+        CP_CHECK(s.freeBlocks == 0 && s.trimmed == 3);
+        survivor = pool.make<CountedPhone>("Survivor");
+    }
+    // Пул уничтожен, продукт жив; последний владелец освобождает и блок, и состояние пула
+    CP_CHECK(survivor->getName() == "Survivor" && CountedPhone::alive == 1);
+    survivor.reset();
+    CP_CHECK(CountedPhone::alive == 0);
+}
+CP_SELFTEST(SelfTest_ProductPoolStats);
+
+// Слияние LOD при крупном масштабе: номера ячеек выходят за 32 бита, далёкие фигуры в одну метку не сливаются
+static void SelfTest_LodClustersKeepDistantCells() {
+    DrwManager m(StorageMode::Packed);
+    m.clear();
+    LodOptions options;
+    options.minScreenSize = 1e9; // все фигуры мелкие
+    options.cellScreenSize = 1.0;
+    m.setLodOptions(options);
+    m.addCircle(Point(0, 5), 1);
+    m.addCircle(Point(1 << 30, 5), 1); // номер ячейки 2^32 при масштабе 4
+    m.addCircle(Point(0, 5), 1);
+    CommandBuffer buf;
+    m.recordShapes(4.0, buf);
+    CP_CHECK(buf.Size() == 2);
+    const DrawCmd* cmds = buf.Commands().data();
+    CP_CHECK(cmds[0].op == DrawOp::Cluster && cmds[0].size == 2 && cmds[0].center.x == 0);
+    CP_CHECK(cmds[1].op == DrawOp::Cluster && cmds[1].size == 1 && cmds[1].center.x == (1 << 30));
+}
+CP_SELFTEST(SelfTest_LodClustersKeepDistantCells);
+
+// Команда как (код, размер, x, y): сравнение кадров с центрами и размерами, а не только по кодам
+using CommandKey = std::tuple<int, int, int, int>;
+
+static CommandKey KeyOf(DrawOp op, int size, Point c) {
+    return std::make_tuple(static_cast<int>(op), size, c.x, c.y);
+}
+
+static std::vector<CommandKey> CommandKeys(const CommandBuffer& buf) {
+    std::vector<CommandKey> keys;
+    for (const DrawCmd& c : buf.Commands())
+        keys.push_back(KeyOf(c.op, c.size, c.center));
+    return keys;
+}
+
+// Разбор вывода BinaryRenderSink в команды по порядку; инстансные кадры разворачиваются по центрам
+static std::vector<CommandKey> DecodeBinaryFrames(const std::string& bytes) {
+    std::size_t pos = 0;
+    auto u32 = [&] {
+        CP_CHECK(pos + 4 <= bytes.size());
+        std::uint32_t v = 0;
+        for (int k = 3; k >= 0; --k)
+            v = (v << 8) | static_cast<unsigned char>(bytes[pos + k]);
+        pos += 4;
+        return v;
+    };
+    auto u8 = [&] {
+        CP_CHECK(pos < bytes.size());
+        return static_cast<DrawOp>(static_cast<unsigned char>(bytes[pos++]));
+    };
+    std::vector<CommandKey> keys;
+    while (pos < bytes.size()) {
+        const std::uint32_t head = u32();
+        if (head & BinaryRenderSink::InstancedFlag) {
+            for (std::uint32_t g = 0; g < (head & ~BinaryRenderSink::InstancedFlag); ++g) {
+                const DrawOp op = u8();
+                const int size = static_cast<int>(u32());
+                const std::uint32_t count = u32();
+                for (std::uint32_t i = 0; i < count; ++i) {
+                    const int x = static_cast<int>(u32());
+                    keys.push_back(KeyOf(op, size, Point(x, static_cast<int>(u32()))));
+                }
+            }
+        }
+        else {
+            for (std::uint32_t i = 0; i < head; ++i) {
+                const DrawOp op = u8();
+                const int x = static_cast<int>(u32());
+                const int y = static_cast<int>(u32());
+                keys.push_back(KeyOf(op, static_cast<int>(u32()), Point(x, y)));
+            }
+        }
+    }
+    return keys;
+}
+
+// Инстансное рисование без группировки по размеру совпадает с drawShapes() во всех режимах команда в команду
+// (код, центр, размер); с группировкой по размеру - тот же набор команд в другом порядке
+static void SelfTest_DrawInstancedMatchesDrawShapes() {
+    const std::string path = "cp_trpo_selftest_instanced.bin";
+    {
+        DrwManager source(StorageMode::Packed);
+        for (int i = 0; i < 300; ++i)
+            source.addSquare(Point(i, 1), i / 50);
+        CP_CHECK(source.saveScene(path));
+    }
+    std::mt19937 rng(29);
+    const StorageMode modes[] = { StorageMode::List, StorageMode::Packed, StorageMode::Arena, StorageMode::Variant,
+                                  StorageMode::Mapped };
+    for (StorageMode mode : modes) {
+        DrwManager m(mode);
+        if (mode == StorageMode::Mapped)
+            CP_CHECK(m.loadScene(path));
+        // Серии одинаковых фигур вперемешку с одиночными
+        for (int i = 0; i < 2000; ++i) {
+            const int size = rng() % 4 == 0 ? static_cast<int>(rng() % 6) : 3;
+            const Point c(static_cast<int>(rng() % 1000), -i);
+            if (rng() % 5 == 0)
+                m.addSquare(c, size);
+            else
+                m.addCircle(c, size);
+        }
+        std::ostringstream want, got;
+        {
+            BinaryRenderSink a(want), b(got);
+            m.drawShapes(a);
+            m.drawInstanced(b, false);
+        }
+        CP_CHECK(DecodeBinaryFrames(got.str()) == DecodeBinaryFrames(want.str()));
+
+        CommandBuffer serial, expanded;
+        m.recordShapes(serial);
+        InstanceBuffer inst;
+        m.recordInstanced(inst, false);
+        inst.Expand(expanded);
+        CP_CHECK(CommandKeys(expanded) == CommandKeys(serial));
+        CP_CHECK(inst.Batches().size() < serial.Size());
+
+        m.recordInstanced(inst, true);
+        expanded.Clear();
+        inst.Expand(expanded);
+        std::vector<CommandKey> a = CommandKeys(serial), b = CommandKeys(expanded);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        CP_CHECK(a == b);
+    }
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_DrawInstancedMatchesDrawShapes);
+
+// removeIf() и compact() в режимах с сохранением порядка: удаляются ровно фигуры по предикату, оставшиеся
+// рисуются в прежнем порядке (сравниваются код, центр и размер каждой команды), счётчики по типам сходятся, после compact() сцена принимает новые фигуры.
+// В режиме Mapped записи файла неизменяемы, поэтому предикат их не задевает
+static void SelfTest_RemoveIfCompactAllModes() {
+    const std::string path = "cp_trpo_selftest_remove.bin";
+    {
+        DrwManager source(StorageMode::Packed);
+        source.clear();
+        for (int i = 0; i < 500; ++i)
+            source.addCircle(Point(3 * i + 1, 2 * i), 1 + i % 4);
+        CP_CHECK(source.saveScene(path));
+    }
+    auto removed = [](Point c) { return c.x % 3 == 0; };
+    auto keptCommands = [&](const CommandBuffer& buf) {
+        CommandBuffer out;
+        for (const DrawCmd& c : buf.Commands())
+            if (!removed(c.center))
+                out.Push(c);
+        return out;
+    };
+    const StorageMode modes[] = { StorageMode::List, StorageMode::Arena, StorageMode::Variant, StorageMode::Mapped };
+    for (StorageMode mode : modes) {
+        DrwManager m(mode);
+        if (mode == StorageMode::Mapped)
+            CP_CHECK(m.loadScene(path));
+        for (int i = 0; i < 1000; ++i) {
+            if (i % 4 == 0)
+                m.addSquare(Point(i, -i), 2);
+            else
+                m.addCircle(Point(i, i), 3);
+        }
+        CommandBuffer before;
+        m.recordShapes(before);
+        const CommandBuffer want = keptCommands(before);
+        std::size_t wantCircles = 0;
+        for (const DrawCmd& c : want.Commands())
+            wantCircles += c.op == DrawOp::Circle;
+
+        CP_CHECK(m.removeIf([&](const Shape& s) { return removed(s.GetCenter()); }) == before.Size() - want.Size());
+        CP_CHECK(m.shapeCount() == want.Size());
+        CP_CHECK(m.countOfType(ShapeType::Circle) == wantCircles);
+        CommandBuffer after;
+        m.recordShapes(after);
+        CP_CHECK(CommandKeys(after) == CommandKeys(want));
+
+        m.compact();
+        CP_CHECK(m.shapeCount() == want.Size() && m.countOfType(ShapeType::Circle) == wantCircles);
+        after.Clear();
+        m.recordShapes(after);
+        CP_CHECK(CommandKeys(after) == CommandKeys(want));
+
+        m.addSquare(Point(7, 7), 7);
+        CP_CHECK(m.shapeCount() == want.Size() + 1);
+        CP_CHECK(m.removeIf([](const Shape&) { return false; }) == 0);
+        const std::size_t fileShapes = mode == StorageMode::Mapped ? 500 : 0;
+        CP_CHECK(m.removeIf([](const Shape&) { return true; }) == want.Size() + 1 - fileShapes);
+        m.compact();
+        CP_CHECK(m.shapeCount() == fileShapes && m.countOfType(ShapeType::Square) == 0);
+    }
+    std::remove(path.c_str());
+}
+CP_SELFTEST(SelfTest_RemoveIfCompactAllModes);
+
+// PhoneCatalog::Build(): порядок продуктов - по заявкам, внутри заявки по именам - не зависит
+// ни от числа потоков пула, ни от размера куска; число пачек равно числу кусков заявок
+static void SelfTest_PhoneCatalogOrderIsStable() {
+    std::vector<std::string> smartStorage;
+    std::vector<std::string> basicStorage;
+    for (int i = 0; i < 1000; ++i) {
+        smartStorage.push_back("Selftest Smartphone Model " + std::to_string(i));
+        basicStorage.push_back("Selftest Basic Model " + std::to_string(i));
+    }
+    const std::vector<std::string_view> smartNames(smartStorage.begin(), smartStorage.end());
+    const std::vector<std::string_view> basicNames(basicStorage.begin(), basicStorage.end());
+    std::vector<CatalogRequest> requests = PhoneCatalog::ForAllBrands(smartNames, basicNames);
+    CP_CHECK(!requests.empty());
+    requests.push_back(CatalogRequest{ requests.front().brand, PhoneKind::BasicPhone, NameSpan(smartNames.data(), 17) });
+    requests.push_back(CatalogRequest{ requests.front().brand, PhoneKind::Smartphone, NameSpan() });
+
+    std::vector<std::tuple<BrandId, PhoneKind, std::string>> want;
+    for (const CatalogRequest& r : requests)
+        for (std::string_view name : r.names)
+            want.emplace_back(r.brand, r.kind, std::string(name));
+
+    for (unsigned threads : { 1u, 2u, 4u, 8u }) {
+        WorkStealingPool pool(threads);
+        for (std::size_t chunk : { std::size_t(0), std::size_t(1), std::size_t(7), std::size_t(64),
+                                   PhoneCatalog::DefaultChunk, std::size_t(100000) }) {
+            const PhoneCatalog catalog = PhoneCatalog::Build(pool, requests, chunk);
+            CP_CHECK(catalog.size() == want.size());
+            const std::size_t step = std::max<std::size_t>(chunk, 1);
+            std::size_t parts = 0;
+            for (const CatalogRequest& r : requests)
+                parts += (r.names.size() + step - 1) / step;
+            CP_CHECK(catalog.parts().size() == parts);
+
+            std::vector<std::tuple<BrandId, PhoneKind, std::string>> got;
+            got.reserve(want.size());
+            catalog.forEach([&](BrandId brand, PhoneKind kind, const Phone& phone) {
+                got.emplace_back(brand, kind, std::string(phone.getName()));
+            });
+            CP_CHECK(got == want);
+        }
+    }
+}
+CP_SELFTEST(SelfTest_PhoneCatalogOrderIsStable);
+
+// Отложенные продукты при заполненной общей таблице имён: создание не бросает, имя копируется в продукт.
+// Таблица остаётся заполненной до конца процесса, поэтому тест стоит последним
+static void SelfTest_LazyPhoneSurvivesFullNameTable() {
+    NokiaFactory factory;
+    NameTable& table = NameTable::global();
+    std::uint32_t id = 0;
+    for (std::size_t i = 0; table.size() < table.capacity(); ++i)
+        CP_CHECK(table.tryInternId("fill " + std::to_string(i), id));
+    CP_CHECK(!table.tryInternId("Lazy Model After Fill", id));
+
+    const std::string longName = "Lazy Model After Fill";
+    LazyPhone phone = factory.createLazySmartphone(longName);
+    LazyPhone shortPhone = factory.createLazyBasicPhone("Lazy Short");
+    CP_CHECK(!phone.isInterned() && phone.getName() == longName && phone.getName().data() != longName.data());
+    CP_CHECK(!shortPhone.isInterned() && shortPhone.getName() == "Lazy Short");
+    const std::unique_ptr<Phone> full = phone.materialize();
+    CP_CHECK(full->getName() == longName);
+
+    LazyPhone repeated = factory.createLazySmartphone("fill 7");
+    CP_CHECK(repeated.isInterned() && repeated.getName() == "fill 7");
+    CP_CHECK(table.size() == table.capacity());
+}
+CP_SELFTEST(SelfTest_LazyPhoneSurvivesFullNameTable);
+
+int main(int argc, char** argv) {
+    const char* filter = argc > 1 ? argv[1] : "";
+    int failed = 0;
+    for (const SelfTestCase& test : SelfTestRegistry()) {
+        if (!std::strstr(test.name, filter))
+            continue;
+        try {
+            test.fn();
+            std::printf("ok   %s\n", test.name);
+        } catch (const std::exception& e) {
+            std::printf("FAIL %s: %s\n", test.name, e.what());
+            ++failed;
+        }
+    }
+    return failed ? 1 : 0;
+}
+#else
+int main() {
+    // Фабрики берутся из реестра: новый производитель, зарегистрированный через REGISTER_PHONE_FACTORY,
+    // попадает в вывод без изменения этого кода. Вывод копится в буфере и уходит в std::cout одной записью.
+    // Для заранее известного набора продуктов есть путь без фабрик: WriteCatalogReport(out, DefaultPhoneCatalog)
+    std::ios::sync_with_stdio(false);
+    StreamWriter console(std::cout);
+    BufferedWriter out(console);
+    WriteManufacturerReport(out);
+    out.Flush();
+
+    return 0;
+}
+#endif